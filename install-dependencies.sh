@@ -2,11 +2,11 @@
 
 if which apt-get >/dev/null 2>/dev/null; then
 sudo apt-get update -qq -y
-sudo apt-get install -qq -y git libjson-c-dev pkg-config libtool cmake
+sudo apt-get install -qq -y git libjson-c-dev zlib1g-dev pkg-config libtool cmake
 wget http://security.ubuntu.com/ubuntu/pool/main/j/json-c/libjson-c-dev_0.11-3ubuntu1.2_amd64.deb http://security.ubuntu.com/ubuntu/pool/main/j/json-c/libjson-c2_0.11-3ubuntu1.2_amd64.deb
 sudo dpkg -i ./libjson-c-dev_0.11-3ubuntu1.2_amd64.deb libjson-c2_0.11-3ubuntu1.2_amd64.deb
 else
-sudo yum install -y git json-c-devel pkg-config libtool cmake
+sudo yum install -y git json-c-devel zlib-devel pkg-config libtool cmake
 fi
 
 (
@@ -66,6 +66,9 @@ typedef enum MSG_TYPE {
     MSG_NTF_GETHISTORY,
     MSG_VALIDATE,
     MSG_COMMIT,
+    MSG_DESIREDCONFIG,
+    MSG_TRANSACTION,
+    MSG_CANCEL,
     SCH_QUERY = 100,
     SCH_MERGE = 101
 } MSG_TYPE;
@@ -59,12 +59,16 @@
 #include <syslog.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
 #include <grp.h>
 #include <signal.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <nc_client.h>
+#include <zlib.h>
 
 #include "../config.h"
 
@@ -106,16 +110,44 @@ pthread_rwlock_t session_lock; /**< mutex protecting netconf_sessions_list from
 pthread_mutex_t ntf_history_lock; /**< mutex protecting notification history list */
 pthread_mutex_t ntf_hist_clbc_mutex; /**< mutex protecting notification history list */
 pthread_mutex_t json_lock; /**< mutex for protecting json-c calls */
+pthread_mutex_t query_cache_lock; /**< mutex protecting the schema query cache */
+pthread_mutex_t schema_bundles_lock; /**< mutex protecting the precompiled schema bundles */
+pthread_mutex_t read_requests_lock; /**< mutex protecting the list of pending read requests */
+pthread_cond_t read_requests_cond; /**< signalled when a pending read request finishes */
+pthread_mutex_t commit_batches_lock; /**< mutex protecting the write-behind commit batches */
+pthread_cond_t commit_batches_cond; /**< signalled when a batch is committed or receives an edit */
+pthread_mutex_t requests_lock; /**< mutex protecting the list of requests being processed */
 
 unsigned int session_key_generator = 1;
 struct session_with_mutex *netconf_sessions_list = NULL;
 static const char *sockname;
 static pthread_key_t notif_history_key;
 pthread_key_t err_reply_key;
+static pthread_key_t request_ctx_key;
 volatile int isterminated = 0;
 static char* password;
 int daemonize;
 
+/**
+ * \brief Cached serialized result of a schema query (SCH_QUERY)
+ */
+struct query_cache_entry {
+    const struct ly_ctx *ctx;   /**< context the query was resolved in */
+    int load_children;          /**< load_children flag of the query */
+    uint32_t hash;              /**< hash of filter */
+    char *filter;               /**< serialized filter array */
+    char *data;                 /**< serialized query result */
+    size_t size;                /**< memory accounted for this entry */
+
+    struct query_cache_entry *prev;
+    struct query_cache_entry *next;
+};
+
+static struct query_cache_entry *query_cache_head = NULL; /**< most recently used entry */
+static struct query_cache_entry *query_cache_tail = NULL; /**< least recently used entry */
+static size_t query_cache_size = 0;
+static struct schema_bundle_set *schema_bundles = NULL; /**< bundles shared by sessions with the same schema */
+
 json_object *create_ok_reply(void);
 json_object *create_data_reply(const char *data);
 static char *netconf_getschema(unsigned int session_key, const char *identifier, const char *version,
@@ -123,6 +155,20 @@ static char *netconf_getschema(unsigned int session_key, const char *identifier,
 static void node_add_metadata_recursive(struct lyd_node *data_tree, const struct lys_module *module,
                                         json_object *data_json_parent);
 static void node_metadata_typedef(struct lys_tpdf *tpdf, json_object *parent);
+static void query_cache_flush_ctx(const struct ly_ctx *ctx);
+static void config_cache_free(struct config_cache *cache);
+static void config_changed(unsigned int session_key);
+static void commit_batch_create(unsigned int session_key, unsigned int window, unsigned int max_edits);
+static void commit_batch_remove(unsigned int session_key);
+static void commit_batch_edit(unsigned int session_key);
+static uint64_t ctx_schema_hash(const struct ly_ctx *ctx);
+static uint64_t session_schema_hash(struct session_with_mutex *s);
+static json_object *edit_validate_locally(unsigned int session_key, NC_DATASTORE target, NC_RPC_EDIT_DFLTOP defop,
+                                         NC_RPC_EDIT_TESTOPT testopt, const char *config);
+static void *schema_bundle_thread(void *arg);
+static struct schema_bundle_set *schema_bundle_acquire(uint64_t schema_hash, int *build);
+static void schema_bundle_release(struct schema_bundle_set *set);
+char *get_param_string(json_object *data, const char *name);
 
 static void
 signal_handler(int sign)
@@ -336,15 +382,287 @@ free_err_reply()
     }
 }
 
+/**
+ * \brief Deadline and cancellation of the request processed by a thread
+ */
+struct request_ctx {
+    char *id;                   /**< request-id of the frontend, can be NULL */
+    struct timespec deadline;   /**< CLOCK_REALTIME */
+    volatile char cancelled;
+    struct request_ctx *next;
+};
+
+static struct request_ctx *requests;
+
+static int
+request_default_timeout(int operation)
+{
+    switch (operation) {
+    case MSG_GET:
+    case MSG_GETCONFIG:
+    case MSG_GETSCHEMA:
+    case MSG_NTF_GETHISTORY:
+    case SCH_QUERY:
+        return RPC_TIMEOUT_READ;
+    case MSG_EDITCONFIG:
+    case MSG_COPYCONFIG:
+    case MSG_DELETECONFIG:
+    case MSG_GENERIC:
+    case MSG_VALIDATE:
+    case MSG_COMMIT:
+    case MSG_DESIREDCONFIG:
+    case MSG_TRANSACTION:
+    case SCH_MERGE:
+        return RPC_TIMEOUT_WRITE;
+    default:
+        return RPC_TIMEOUT_OTHER;
+    }
+}
+
+static void
+timespec_add_ms(struct timespec *ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ++ts->tv_sec;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * \brief Start processing a request in this thread, its deadline is set from "deadline" (milliseconds
+ * since the Epoch) or "timeout" (milliseconds), the default depends on the operation.
+ */
+static void
+request_begin(json_object *request, int operation)
+{
+    struct request_ctx *ctx;
+    json_object *obj;
+    int64_t deadline = 0;
+    long timeout;
+
+    ctx = calloc(1, sizeof *ctx);
+    if (!ctx) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return;
+    }
+    timeout = request_default_timeout(operation);
+
+    pthread_mutex_lock(&json_lock);
+    ctx->id = get_param_string(request, "request-id");
+    if (json_object_object_get_ex(request, "timeout", &obj) == TRUE) {
+        timeout = json_object_get_int(obj);
+    }
+    if (json_object_object_get_ex(request, "deadline", &obj) == TRUE) {
+        deadline = json_object_get_int64(obj);
+    }
+    pthread_mutex_unlock(&json_lock);
+
+    if (deadline > 0) {
+        ctx->deadline.tv_sec = deadline / 1000;
+        ctx->deadline.tv_nsec = (deadline % 1000) * 1000000;
+    } else {
+        clock_gettime(CLOCK_REALTIME, &ctx->deadline);
+        timespec_add_ms(&ctx->deadline, (timeout > 0) ? timeout : 0);
+    }
+
+    pthread_mutex_lock(&requests_lock);
+    ctx->next = requests;
+    requests = ctx;
+    pthread_mutex_unlock(&requests_lock);
+    pthread_setspecific(request_ctx_key, ctx);
+}
+
+/**
+ * \brief Finish processing the request of this thread.
+ */
+static void
+request_end(void)
+{
+    struct request_ctx *ctx, *prev;
+
+    ctx = pthread_getspecific(request_ctx_key);
+    if (!ctx) {
+        return;
+    }
+    pthread_setspecific(request_ctx_key, NULL);
+
+    pthread_mutex_lock(&requests_lock);
+    if (requests == ctx) {
+        requests = ctx->next;
+    } else {
+        for (prev = requests; prev->next != ctx; prev = prev->next);
+        prev->next = ctx->next;
+    }
+    pthread_mutex_unlock(&requests_lock);
+
+    free(ctx->id);
+    free(ctx);
+}
+
+/**
+ * \brief Cancel all the requests with the request-id.
+ *
+ * \return Number of cancelled requests.
+ */
+static int
+request_cancel(const char *id)
+{
+    struct request_ctx *ctx;
+    int count = 0;
+
+    pthread_mutex_lock(&requests_lock);
+    for (ctx = requests; ctx; ctx = ctx->next) {
+        if (ctx->id && !strcmp(ctx->id, id)) {
+            ctx->cancelled = 1;
+            ++count;
+        }
+    }
+    pthread_mutex_unlock(&requests_lock);
+    return count;
+}
+
+/**
+ * \brief Get the time limit of waiting, the deadline of the request of this thread if there is one.
+ *
+ * \param[in] timeout Timeout in milliseconds used outside of requests.
+ * \param[out] limit Time limit (CLOCK_REALTIME).
+ */
+static void
+request_deadline(int timeout, struct timespec *limit)
+{
+    struct request_ctx *ctx;
+
+    ctx = pthread_getspecific(request_ctx_key);
+    if (ctx) {
+        *limit = ctx->deadline;
+    } else {
+        clock_gettime(CLOCK_REALTIME, limit);
+        timespec_add_ms(limit, timeout);
+    }
+}
+
+/**
+ * \brief Get how long to wait before checking the request cancellation again.
+ *
+ * \param[in] limit Time limit from request_deadline().
+ * \param[in] slice Maximum time to return, 0 for no maximum.
+ * \return Milliseconds, 0 if the time limit passed or the request was cancelled.
+ */
+static int
+request_wait_time(const struct timespec *limit, int slice)
+{
+    struct request_ctx *ctx;
+    struct timespec now;
+    long remaining;
+
+    ctx = pthread_getspecific(request_ctx_key);
+    if (ctx && ctx->cancelled) {
+        return 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    remaining = (limit->tv_sec - now.tv_sec) * 1000 + (limit->tv_nsec - now.tv_nsec) / 1000000;
+    if (remaining <= 0) {
+        return 0;
+    }
+    return (slice && (remaining > slice)) ? slice : remaining;
+}
+
+/**
+ * \brief Error reply of a request whose waiting was abandoned.
+ */
+static json_object *
+request_abandoned_reply(void)
+{
+    struct request_ctx *ctx;
+
+    ctx = pthread_getspecific(request_ctx_key);
+    if (ctx && ctx->cancelled) {
+        return create_error_reply("Request cancelled.");
+    }
+    return create_error_reply("Request timed out.");
+}
+
+/**
+ * \brief Wait on a condition variable for at most REQUEST_POLL_SLICE, give up on the time limit
+ * or the request cancellation. The caller re-checks its condition after every wait.
+ *
+ * \param[in] limit Time limit from request_deadline().
+ * \return 0 after waiting, ETIMEDOUT if the time limit passed or the request was cancelled.
+ */
+static int
+request_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *limit)
+{
+    struct timespec slice;
+    int wait;
+
+    if (!(wait = request_wait_time(limit, REQUEST_POLL_SLICE))) {
+        return ETIMEDOUT;
+    }
+    clock_gettime(CLOCK_REALTIME, &slice);
+    timespec_add_ms(&slice, wait);
+    pthread_cond_timedwait(cond, mutex, &slice);
+    return 0;
+}
+
+/**
+ * \brief Sleep, give up on the request deadline or cancellation.
+ *
+ * \param[in] ms Milliseconds to sleep.
+ * \return 0 after sleeping for the whole time, ETIMEDOUT otherwise.
+ */
+static int
+request_sleep(int ms)
+{
+    struct timespec end, limit;
+    int wait;
+
+    clock_gettime(CLOCK_REALTIME, &end);
+    timespec_add_ms(&end, ms);
+    request_deadline(ms, &limit);
+    while ((wait = request_wait_time(&end, REQUEST_POLL_SLICE))) {
+        if (!request_wait_time(&limit, 0)) {
+            return ETIMEDOUT;
+        }
+        usleep(wait * 1000);
+    }
+    return request_wait_time(&limit, 0) ? 0 : ETIMEDOUT;
+}
+
+/* lock the session mutex, give up on the request deadline or cancellation */
+static int
+session_mutex_lock(struct session_with_mutex *locked_session)
+{
+    struct timespec limit, slice;
+    int wait, ret;
+
+    if (!pthread_getspecific(request_ctx_key)) {
+        return pthread_mutex_lock(&locked_session->lock);
+    }
+
+    request_deadline(0, &limit);
+    while ((wait = request_wait_time(&limit, REQUEST_POLL_SLICE))) {
+        clock_gettime(CLOCK_REALTIME, &slice);
+        timespec_add_ms(&slice, wait);
+        ret = pthread_mutex_timedlock(&locked_session->lock, &slice);
+        if (ret != ETIMEDOUT) {
+            return ret;
+        }
+    }
+    return ETIMEDOUT;
+}
+
 static struct session_with_mutex *
 session_get_locked(unsigned int session_key, json_object **err)
 {
     struct session_with_mutex *locked_session;
+    int ret;
 
     /* get non-exclusive (read) access to sessions_list (conns) */
     DEBUG("LOCK wrlock %s", __func__);
     if (pthread_rwlock_rdlock(&session_lock) != 0) {
-        if (*err) {
+        if (err) {
             *err = create_error_reply("Locking failed.");
         }
         return NULL;
@@ -354,7 +672,7 @@ session_get_locked(unsigned int session_key, json_object **err)
          locked_session && (locked_session->session_key != session_key);
          locked_session = locked_session->next);
     if (!locked_session) {
-        if (*err) {
+        if (err) {
             *err = create_error_reply("Session not found.");
         }
         goto rwlock_fail;
@@ -362,9 +680,9 @@ session_get_locked(unsigned int session_key, json_object **err)
 
     /* get exclusive access to session */
     DEBUG("LOCK mutex %s", __func__);
-    if (pthread_mutex_lock(&locked_session->lock) != 0) {
-        if (*err) {
-            *err = create_error_reply("Locking failed.");
+    if ((ret = session_mutex_lock(locked_session)) != 0) {
+        if (err) {
+            *err = (ret == ETIMEDOUT) ? request_abandoned_reply() : create_error_reply("Locking failed.");
         }
         goto rwlock_fail;
     }
@@ -1126,6 +1444,85 @@ node_metadata_model(const struct lys_module *module, json_object *parent)
  * @{
  */
 
+/**
+ * \brief Remember an RPC whose reply is not waited for anymore, it is received and dropped later
+ * so that it does not stay in the reply queue of the session.
+ *
+ * \param[in] s Session, it must be locked.
+ */
+static void
+session_abandon_reply(struct session_with_mutex *s, uint64_t msgid)
+{
+    if (s->abandoned_count == ABANDONED_REPLY_MAX) {
+        ERROR("Too many abandoned replies of session %u, forgetting the oldest one.", s->session_key);
+        memmove(s->abandoned, s->abandoned + 1, (ABANDONED_REPLY_MAX - 1) * sizeof *s->abandoned);
+        --s->abandoned_count;
+    }
+    s->abandoned[s->abandoned_count++] = msgid;
+}
+
+/**
+ * \brief Drop the abandoned replies of a session that have arrived meanwhile, without waiting.
+ *
+ * \param[in] s Session, it must be locked.
+ */
+static void
+session_drain_replies(struct session_with_mutex *s)
+{
+    struct nc_rpc *rpc;
+    struct nc_reply *reply;
+    NC_MSG_TYPE msgt;
+    unsigned int i, j;
+
+    if (!s->abandoned_count) {
+        return;
+    }
+
+    /* the replies are parsed only to be freed, any RPC does */
+    rpc = nc_rpc_get(NULL, 0, NC_PARAMTYPE_CONST);
+    if (!rpc) {
+        return;
+    }
+    for (i = j = 0; i < s->abandoned_count; ++i) {
+        do {
+            reply = NULL;
+            msgt = nc_recv_reply(s->session, rpc, s->abandoned[i], 0, 0, &reply);
+            nc_reply_free(reply);
+        } while (msgt == NC_MSG_NOTIF);
+        if (msgt == NC_MSG_WOULDBLOCK) {
+            /* not received yet */
+            s->abandoned[j++] = s->abandoned[i];
+        } else {
+            DEBUG("Dropped abandoned reply of session %u.", s->session_key);
+        }
+    }
+    s->abandoned_count = j;
+    nc_rpc_free(rpc);
+}
+
+/**
+ * \brief Receive the reply of an RPC, the request of this thread can be cancelled meanwhile.
+ *
+ * \return NC_MSG_WOULDBLOCK if the time limit passed or the request was cancelled, the reply
+ * is abandoned and the session can be used further.
+ */
+static NC_MSG_TYPE
+netconf_recv_reply_until(struct nc_session *session, struct nc_rpc *rpc, uint64_t msgid, const struct timespec *limit,
+                         int parseroptions, struct nc_reply **reply)
+{
+    NC_MSG_TYPE ret;
+    int wait;
+
+    do {
+        if (!(wait = request_wait_time(limit, REQUEST_POLL_SLICE))) {
+            return NC_MSG_WOULDBLOCK;
+        }
+        ret = nc_recv_reply(session, rpc, msgid, wait, parseroptions, reply);
+    } while ((ret == NC_MSG_NOTIF) || (ret == NC_MSG_WOULDBLOCK));
+
+    return ret;
+}
+
 /**
  * \brief Send RPC and wait for reply with timeout.
  *
@@ -1133,21 +1530,36 @@ node_metadata_model(const struct lys_module *module, json_object *parent)
  * \param[in] rpc     prepared RPC message
  * \param[in] timeout timeout in miliseconds, -1 for blocking, 0 for non-blocking
  * \param[out] reply  reply from the server
+ * \param[out] abandoned Set to the message ID of the sent RPC if its reply was not waited for, 0 otherwise,
+ * can be NULL.
  * \return NC_MSG_WOULDBLOCK or NC_MSG_ERROR.
  * On success, it returns NC_MSG_REPLY.
  */
 NC_MSG_TYPE
-netconf_send_recv_timed(struct nc_session *session, struct nc_rpc *rpc, int timeout, int strict, struct nc_reply **reply)
+netconf_send_recv_timed(struct nc_session *session, struct nc_rpc *rpc, int timeout, int strict, struct nc_reply **reply,
+                        uint64_t *abandoned)
 {
     uint64_t msgid;
     NC_MSG_TYPE ret;
-    ret = nc_send_rpc(session, rpc, timeout, &msgid);
+    struct timespec limit;
+    int wait;
+
+    if (abandoned) {
+        *abandoned = 0;
+    }
+    request_deadline(timeout, &limit);
+    if (!(wait = request_wait_time(&limit, 0))) {
+        return NC_MSG_WOULDBLOCK;
+    }
+    ret = nc_send_rpc(session, rpc, wait, &msgid);
     if (ret != NC_MSG_RPC) {
         return ret;
     }
 
-    while ((ret = nc_recv_reply(session, rpc, msgid, timeout, (strict ? LYD_OPT_STRICT : 0), reply)) == NC_MSG_NOTIF);
-
+    ret = netconf_recv_reply_until(session, rpc, msgid, &limit, (strict ? LYD_OPT_STRICT : 0), reply);
+    if ((ret == NC_MSG_WOULDBLOCK) && abandoned) {
+        *abandoned = msgid;
+    }
     return ret;
 }
 
@@ -1162,6 +1574,7 @@ netconf_connect(const char *host, const char *port, const char *user, const char
     struct nc_session* session = NULL;
     struct session_with_mutex *locked_session, *last_session;
     char *pubkey;
+    int build;
 
     /* connect to the requested NETCONF server */
     password = (char*)pass;
@@ -1190,9 +1603,14 @@ netconf_connect(const char *host, const char *port, const char *user, const char
             return 0;
         }
         locked_session->session = session;
+        locked_session->schema_set_id = ly_ctx_get_module_set_id(nc_session_get_ctx(session));
+        locked_session->schema_hash = ctx_schema_hash(nc_session_get_ctx(session));
         locked_session->hello_message = NULL;
         locked_session->closed = 0;
+        locked_session->refs = 1;
         pthread_mutex_init(&locked_session->lock, NULL);
+        pthread_mutex_init(&locked_session->cache_lock, NULL);
+        pthread_mutex_init(&locked_session->notif_filters_lock, NULL);
         DEBUG("Before session_lock");
         /* get exclusive access to sessions_list (conns) */
         DEBUG("LOCK wrlock %s", __func__);
@@ -1224,6 +1642,22 @@ netconf_connect(const char *host, const char *port, const char *user, const char
             session_key_generator = 1;
         }
 
+        /* precompile schema metadata of all the modules in the background, unless a session
+         * with the same schema has already done it (or is doing it) */
+        locked_session->bundles = schema_bundle_acquire(locked_session->schema_hash, &build);
+        if (build) {
+            if (pthread_create(&locked_session->bundle_thread, NULL, schema_bundle_thread, locked_session) != 0) {
+                ERROR("Creating schema precompilation thread failed.");
+                if (locked_session->bundles) {
+                    pthread_mutex_lock(&schema_bundles_lock);
+                    locked_session->bundles->building = 0;
+                    pthread_mutex_unlock(&schema_bundles_lock);
+                }
+            } else {
+                locked_session->bundle_thread_running = 1;
+            }
+        }
+
         DEBUG("Before session_unlock");
         /* unlock session list */
         DEBUG("UNLOCK wrlock %s", __func__);
@@ -1238,17 +1672,84 @@ netconf_connect(const char *host, const char *port, const char *user, const char
     return 0;
 }
 
+/**
+ * \brief Take a reference of a session structure, the session is in the sessions list
+ * (locked) or the caller holds a reference already.
+ */
+void
+session_ref(struct session_with_mutex *locked_session)
+{
+    __atomic_fetch_add(&locked_session->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Release a reference of a session structure, the last one frees it. The session
+ * is closed by then, so neither its notification thread nor any request uses it.
+ */
+void
+session_unref(struct session_with_mutex *locked_session)
+{
+    int i;
+
+    if (__atomic_sub_fetch(&locked_session->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    notif_ring_clean(&locked_session->notif_ring);
+    free(locked_session->notif_stream);
+    free(locked_session->notif_filter);
+    for (i = 0; i < NOTIF_FILTER_MAX; ++i) {
+        free(locked_session->notif_filters[i].xpath);
+    }
+    pthread_mutex_destroy(&locked_session->notif_filters_lock);
+    schema_bundle_release(locked_session->bundles);
+    config_cache_free(locked_session->config_cache);
+    free(locked_session->delta_filter);
+    pthread_mutex_destroy(&locked_session->cache_lock);
+    pthread_mutex_destroy(&locked_session->lock);
+    if (locked_session->hello_message != NULL) {
+        json_object_put(locked_session->hello_message);
+        locked_session->hello_message = NULL;
+    }
+    free(locked_session);
+    DEBUG("NETCONF session closed, everything cleared.");
+}
+
 static int
 close_and_free_session(struct session_with_mutex *locked_session)
 {
     int i;
 
+    /* fail the waiting write-behind commit, whichever way the session is being closed */
+    commit_batch_remove(locked_session->session_key);
+
     DEBUG("LOCK mutex %s", __func__);
     if (pthread_mutex_lock(&locked_session->lock) != 0) {
         ERROR("Error while locking rwlock");
     }
-    locked_session->closed = 1;
+    /* read by the websocket service without the lock */
+    __atomic_store_n(&locked_session->closed, 1, __ATOMIC_RELEASE);
+#ifdef WITH_NOTIFICATIONS
+    if (locked_session->session != NULL) {
+        /* disconnect its websocket clients */
+        notification_wakeup(nc_session_get_id(locked_session->session));
+    }
+#endif
+    if (locked_session->bundle_thread_running) {
+        /* the thread uses the session context */
+        locked_session->bundle_cancel = 1;
+        pthread_join(locked_session->bundle_thread, NULL);
+        locked_session->bundle_thread_running = 0;
+    }
     if (locked_session->session != NULL) {
+        query_cache_flush_ctx(nc_session_get_ctx(locked_session->session));
+        /* data of the session context */
+        lyd_free_withsiblings(locked_session->delta_tree);
+        locked_session->delta_tree = NULL;
+        for (i = 0; i < 3; ++i) {
+            lyd_free_withsiblings(locked_session->config_trees[i].tree);
+            locked_session->config_trees[i].tree = NULL;
+        }
         nc_session_free(locked_session->session, NULL);
         locked_session->session = NULL;
     }
@@ -1261,20 +1762,8 @@ close_and_free_session(struct session_with_mutex *locked_session)
     DEBUG("closed session, disabled notif(?), wait 0.5s");
     usleep(500000); /* let notification thread stop */
 
-    /* session shouldn't be used by now */
-    for (i = 0; i < locked_session->notif_count; ++i) {
-        free(locked_session->notifications[i].content);
-    }
-    free(locked_session->notifications);
-    pthread_mutex_destroy(&locked_session->lock);
-    if (locked_session->hello_message != NULL) {
-        json_object_put(locked_session->hello_message);
-        locked_session->hello_message = NULL;
-    }
-    locked_session->session = NULL;
-    free(locked_session);
-    locked_session = NULL;
-    DEBUG("NETCONF session closed, everything cleared.");
+    /* freed now unless the websocket service still holds it */
+    session_unref(locked_session);
     return (EXIT_SUCCESS);
 }
 
@@ -1367,6 +1856,13 @@ netconf_test_reply(struct nc_session *session, unsigned int session_key, NC_MSG_
                 (*data) = NULL;
             }
             return NULL;
+        case NC_MSG_WOULDBLOCK:
+            /* cancelled or timed out */
+            if (data != NULL) {
+                free(*data);
+                (*data) = NULL;
+            }
+            return request_abandoned_reply();
         case NC_MSG_REPLY:
             switch (reply->type) {
                 case NC_RPL_OK:
@@ -1424,7 +1920,7 @@ netconf_unlocked_op(struct nc_session *session, struct nc_rpc *rpc)
 
     if (session != NULL) {
         /* send the request and get the reply */
-        msgt = netconf_send_recv_timed(session, rpc, 50000, 0, &reply);
+        msgt = netconf_send_recv_timed(session, rpc, RPC_TIMEOUT_OTHER, 0, &reply, NULL);
         /* process the result of the operation */
         return netconf_test_reply(session, 0, msgt, reply, NULL);
     } else {
@@ -1449,6 +1945,7 @@ netconf_op(unsigned int session_key, struct nc_rpc *rpc, int strict, struct lyd_
     json_object *res = NULL;
     struct lyd_node *data = NULL;
     NC_MSG_TYPE msgt;
+    uint64_t msgid;
 
     /* check requests */
     if (rpc == NULL) {
@@ -1465,9 +1962,13 @@ netconf_op(unsigned int session_key, struct nc_rpc *rpc, int strict, struct lyd_
     }
 
     session_user_activity(nc_session_get_username(locked_session->session));
+    session_drain_replies(locked_session);
 
     /* send the request and get the reply */
-    msgt = netconf_send_recv_timed(locked_session->session, rpc, 2000000, strict, &reply);
+    msgt = netconf_send_recv_timed(locked_session->session, rpc, RPC_TIMEOUT_WRITE, strict, &reply, &msgid);
+    if (msgid) {
+        session_abandon_reply(locked_session, msgid);
+    }
 
     session_unlock(locked_session);
 
@@ -1486,69 +1987,486 @@ finished:
     return res;
 }
 
-static char *
-netconf_getconfig(unsigned int session_key, NC_DATASTORE source, const char *filter, int strict, json_object **err)
+/**
+ * \brief Send several RPCs at once and only then receive all their replies.
+ *
+ * \param[in] session_key Session.
+ * \param[in] rpcs RPCs to send in this order.
+ * \param[in] count Number of RPCs.
+ * \param[out] replies OK or error reply of every RPC.
+ */
+static void
+netconf_pipeline(unsigned int session_key, struct nc_rpc **rpcs, int count, json_object **replies)
 {
-    struct nc_rpc* rpc;
     struct session_with_mutex *locked_session;
-    json_object *res = NULL, *data_cjson;
-    enum json_tokener_error tok_err;
-    char *data_json = NULL;
-    struct lyd_node *data, *sibling, *next;
+    struct nc_reply *reply;
+    struct lyd_node *data;
+    json_object *err = NULL;
+    uint64_t *msgids;
+    NC_MSG_TYPE msgt;
+    struct timespec limit;
+    int i, wait;
 
-    /* tell server to show all elements even if they have default values */
-#ifdef HAVE_WITHDEFAULTS_TAGGED
-    rpc = nc_rpc_getconfig(source, filter, NC_WD_MODE_ALL_TAG, NC_PARAMTYPE_CONST);
-#else
-    rpc = nc_rpc_getconfig(source, filter, 0, NC_PARAMTYPE_CONST);
-#endif
-    if (rpc == NULL) {
-        ERROR("mod_netconf: creating rpc request failed");
-        return (NULL);
+    msgids = calloc(count, sizeof *msgids);
+    locked_session = msgids ? session_get_locked(session_key, &err) : NULL;
+    if (!locked_session) {
+        for (i = 0; i < count; ++i) {
+            replies[i] = err ? err : create_error_reply("Unknown session or locking failed.");
+            err = NULL;
+        }
+        free(msgids);
+        return;
     }
-
-    res = netconf_op(session_key, rpc, strict, &data);
-    nc_rpc_free(rpc);
-    if (res != NULL) {
-        (*err) = res;
-    } else {
-        (*err) = NULL;
+    session_user_activity(nc_session_get_username(locked_session->session));
+    session_drain_replies(locked_session);
+
+    request_deadline(RPC_TIMEOUT_WRITE, &limit);
+    for (i = 0; i < count; ++i) {
+        replies[i] = NULL;
+        if (!rpcs[i]) {
+            replies[i] = create_error_reply("Internal: Creating rpc request failed");
+        } else if (!(wait = request_wait_time(&limit, 0))) {
+            replies[i] = request_abandoned_reply();
+        } else if (nc_send_rpc(locked_session->session, rpcs[i], wait, &msgids[i]) != NC_MSG_RPC) {
+            replies[i] = create_error_reply("Sending RPC failed.");
+        }
     }
 
-    if (data) {
-        for (locked_session = netconf_sessions_list;
-             locked_session && (locked_session->session_key != session_key);
-             locked_session = locked_session->next);
-        /* won't fail */
-
-        /* print data into JSON */
-        if (lyd_print_mem(&data_json, data, LYD_JSON, LYP_WITHSIBLINGS)) {
-            ERROR("Printing JSON <get-config> data failed.");
-            lyd_free_withsiblings(data);
-            return NULL;
+    for (i = 0; i < count; ++i) {
+        if (replies[i]) {
+            continue;
         }
-
-        /* parse JSON data into cjson */
-        pthread_mutex_lock(&json_lock);
-        data_cjson = json_tokener_parse_verbose(data_json, &tok_err);
-        if (!data_cjson) {
-            ERROR("Parsing JSON config failed (%s).", json_tokener_error_desc(tok_err));
-            pthread_mutex_unlock(&json_lock);
-            lyd_free_withsiblings(data);
-            free(data_json);
-            return NULL;
+        reply = NULL;
+        data = NULL;
+        msgt = netconf_recv_reply_until(locked_session->session, rpcs[i], msgids[i], &limit, 0, &reply);
+        if (msgt == NC_MSG_WOULDBLOCK) {
+            session_abandon_reply(locked_session, msgids[i]);
         }
-        free(data_json);
+        /* the session must not be closed here, the list is locked */
+        replies[i] = netconf_test_reply(locked_session->session, 0, msgt, reply, &data);
+        nc_reply_free(reply);
+        if (!replies[i]) {
+            /* data reply is a success as well */
+            replies[i] = data ? create_ok_reply() : create_error_reply("Receiving RPC reply failed.");
+        }
+        lyd_free_withsiblings(data);
+    }
+    session_unlock(locked_session);
+    free(msgids);
+}
+
+static int
+reply_is_ok(json_object *reply)
+{
+    json_object *obj;
+    int ok;
+
+    pthread_mutex_lock(&json_lock);
+    ok = (json_object_object_get_ex(reply, "type", &obj) == TRUE) && (json_object_get_int(obj) == REPLY_OK);
+    pthread_mutex_unlock(&json_lock);
+    return ok;
+}
+
+static void
+reply_free(json_object *reply)
+{
+    if (reply) {
+        pthread_mutex_lock(&json_lock);
+        json_object_put(reply);
+        pthread_mutex_unlock(&json_lock);
+    }
+}
+
+/**
+ * \brief State of a single device in an operation performed on a group of sessions in parallel
+ */
+struct group_device {
+    unsigned int session_key;
+    char *config;           /**< edit-config content */
+    json_object *reply;     /**< error reply of the failed step */
+    char locked;            /**< whether the candidate is locked by the operation */
+    char committed;         /**< whether a confirmed commit is pending */
+    json_object *timing;    /**< durations of the steps in milliseconds */
+    const struct group_params *params;
+};
+
+/**
+ * \brief Parameters of an operation performed on a group of sessions, shared by all the devices
+ */
+struct group_params {
+    NC_RPC_EDIT_DFLTOP defop;
+    int confirmed;              /**< confirmed commit checked by a probe */
+    uint32_t confirm_timeout;   /**< confirm-timeout of the confirmed commit in seconds */
+    const char *persist;        /**< persist (and persist-id) of the confirmed commit */
+    const char *probe;          /**< filter of the <get> probe */
+};
+
+static void
+group_device_timing(struct group_device *dev, const char *step, const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&json_lock);
+    json_object_object_add(dev->timing, step, json_object_new_int64((now.tv_sec - start->tv_sec) * 1000
+                                                                   + (now.tv_nsec - start->tv_nsec) / 1000000));
+    pthread_mutex_unlock(&json_lock);
+}
+
+/**
+ * \brief Step performed on a group of devices by a pool of threads
+ */
+struct group_job {
+    struct group_device *devs;
+    int count;
+    int next;                   /**< index of the next device to process, atomic */
+    void *(*step)(void *);
+    int failed;                 /**< whether to include devices that already failed */
+    struct request_ctx *ctx;    /**< request whose deadline and cancellation apply */
+};
+
+/* process the devices until there are none left */
+static void
+group_job_devices(struct group_job *job)
+{
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        if (job->devs[i].reply && !job->failed) {
+            continue;
+        }
+        job->step(&job->devs[i]);
+    }
+}
+
+static void *
+group_job_run(void *arg)
+{
+    struct group_job *job = arg;
+
+    create_err_reply_p();
+    pthread_setspecific(request_ctx_key, job->ctx);
+    group_job_devices(job);
+    free_err_reply();
+    return NULL;
+}
+
+/**
+ * \brief Perform a step on the devices in parallel, by at most TRANSACTION_THREADS threads
+ * (including the calling one).
+ *
+ * \param[in] devs Devices.
+ * \param[in] count Number of devices.
+ * \param[in] step Step routine.
+ * \param[in] failed Whether to include devices that already failed (have an error reply), such a step
+ * (rollback) is not limited by the request deadline nor cancellation.
+ */
+static void
+group_run(struct group_device *devs, int count, void *(*step)(void *), int failed)
+{
+    struct group_job job;
+    struct request_ctx *ctx;
+    pthread_t *threads;
+    int i, workers;
+
+    ctx = pthread_getspecific(request_ctx_key);
+    job.devs = devs;
+    job.count = count;
+    job.next = 0;
+    job.step = step;
+    job.failed = failed;
+    job.ctx = failed ? NULL : ctx;
+
+    workers = (count < TRANSACTION_THREADS) ? count : TRANSACTION_THREADS;
+    threads = (workers > 1) ? calloc(workers - 1, sizeof *threads) : NULL;
+    for (i = 0; threads && (i < workers - 1); ++i) {
+        if (pthread_create(&threads[i], NULL, group_job_run, &job)) {
+            /* the started ones and this thread process the rest */
+            break;
+        }
+    }
+    workers = i;
+
+    pthread_setspecific(request_ctx_key, job.ctx);
+    group_job_devices(&job);
+    pthread_setspecific(request_ctx_key, ctx);
+
+    for (i = 0; i < workers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+/* lock, edit-config and validate the candidate */
+static void *
+group_step_prepare(void *arg)
+{
+    struct group_device *dev = arg;
+    struct nc_rpc *rpcs[3];
+    json_object *replies[3];
+    struct timespec start;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    rpcs[0] = nc_rpc_lock(NC_DATASTORE_CANDIDATE);
+    rpcs[1] = nc_rpc_edit(NC_DATASTORE_CANDIDATE, dev->params->defop, 0, 0, dev->config,
+                          NC_PARAMTYPE_CONST);
+    rpcs[2] = nc_rpc_validate(NC_DATASTORE_CANDIDATE, NULL, NC_PARAMTYPE_CONST);
+    netconf_pipeline(dev->session_key, rpcs, 3, replies);
+
+    dev->locked = reply_is_ok(replies[0]);
+    for (i = 0; i < 3; ++i) {
+        if (!dev->reply && !reply_is_ok(replies[i])) {
+            dev->reply = replies[i];
+        } else {
+            reply_free(replies[i]);
+        }
+        nc_rpc_free(rpcs[i]);
+    }
+
+    group_device_timing(dev, "prepare", &start);
+    return NULL;
+}
+
+/*
+ * commit and unlock the candidate, a confirmed commit keeps the candidate locked until confirmed; a failed commit
+ * keeps it locked as well, so the rollback discards the changes before unlocking it
+ */
+static void *
+group_step_commit(void *arg)
+{
+    struct group_device *dev = arg;
+    const struct group_params *params = dev->params;
+    struct nc_rpc *rpc;
+    json_object *reply;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (params->confirmed) {
+        rpc = nc_rpc_commit(1, params->confirm_timeout, params->persist, NULL, NC_PARAMTYPE_CONST);
+    } else {
+        rpc = nc_rpc_commit(0, 0, NULL, NULL, NC_PARAMTYPE_CONST);
+    }
+    netconf_pipeline(dev->session_key, &rpc, 1, &reply);
+    config_changed(dev->session_key);
+    nc_rpc_free(rpc);
+
+    if (!reply_is_ok(reply)) {
+        dev->reply = reply;
+    } else {
+        reply_free(reply);
+        dev->committed = params->confirmed;
+        if (!params->confirmed) {
+            rpc = nc_rpc_unlock(NC_DATASTORE_CANDIDATE);
+            netconf_pipeline(dev->session_key, &rpc, 1, &reply);
+            reply_free(reply);
+            nc_rpc_free(rpc);
+            dev->locked = 0;
+        }
+    }
+
+    group_device_timing(dev, "commit", &start);
+    return NULL;
+}
+
+/* check the device with a <get> while the confirmed commit is pending */
+static void *
+group_step_probe(void *arg)
+{
+    struct group_device *dev = arg;
+    struct nc_rpc *rpc;
+    json_object *reply;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    rpc = nc_rpc_get(dev->params->probe, 0, NC_PARAMTYPE_CONST);
+    netconf_pipeline(dev->session_key, &rpc, 1, &reply);
+    if (!reply_is_ok(reply)) {
+        dev->reply = reply;
+    } else {
+        reply_free(reply);
+    }
+    nc_rpc_free(rpc);
+
+    group_device_timing(dev, "probe", &start);
+    return NULL;
+}
+
+/* confirm the pending commit and unlock the candidate */
+static void *
+group_step_confirm(void *arg)
+{
+    struct group_device *dev = arg;
+    struct nc_rpc *rpcs[2];
+    json_object *replies[2];
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    rpcs[0] = nc_rpc_commit(0, 0, NULL, dev->params->persist, NC_PARAMTYPE_CONST);
+    rpcs[1] = nc_rpc_unlock(NC_DATASTORE_CANDIDATE);
+    netconf_pipeline(dev->session_key, rpcs, 2, replies);
+    config_changed(dev->session_key);
+
+    if (!reply_is_ok(replies[0])) {
+        /* the device reverts the commit itself when the timeout expires */
+        dev->reply = replies[0];
+    } else {
+        reply_free(replies[0]);
+    }
+    reply_free(replies[1]);
+    dev->locked = 0;
+    dev->committed = 0;
+    nc_rpc_free(rpcs[0]);
+    nc_rpc_free(rpcs[1]);
+
+    group_device_timing(dev, "confirm", &start);
+    return NULL;
+}
+
+/* cancel the pending commit, discard the candidate changes and unlock it */
+static void *
+group_step_rollback(void *arg)
+{
+    struct group_device *dev = arg;
+    struct nc_rpc *rpcs[3];
+    json_object *replies[3];
+    struct timespec start;
+    int i, count = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (dev->committed) {
+        rpcs[count++] = nc_rpc_cancel(dev->params->persist, NC_PARAMTYPE_CONST);
+    }
+    if (dev->locked) {
+        /* without the lock, the changes in the candidate may be someone else's */
+        rpcs[count++] = nc_rpc_discard();
+        rpcs[count++] = nc_rpc_unlock(NC_DATASTORE_CANDIDATE);
+    }
+    if (count) {
+        netconf_pipeline(dev->session_key, rpcs, count, replies);
+        config_changed(dev->session_key);
+    }
+
+    for (i = 0; i < count; ++i) {
+        reply_free(replies[i]);
+        nc_rpc_free(rpcs[i]);
+    }
+    dev->locked = 0;
+    dev->committed = 0;
+
+    group_device_timing(dev, "rollback", &start);
+    return NULL;
+}
+
+static int
+group_failed(struct group_device *devs, int count)
+{
+    int i;
 
-        /* go simultaneously through both trees and add metadata */
-        LY_TREE_FOR_SAFE(data, next, sibling) {
-            node_add_metadata_recursive(sibling, NULL, data_cjson);
-            lyd_free(sibling);
+    for (i = 0; i < count; ++i) {
+        if (devs[i].reply) {
+            return 1;
         }
+    }
+    return 0;
+}
+
+/**
+ * \brief Print data tree into JSON merged with the schema metadata.
+ *
+ * \param[in] data Data tree, it is not modified.
+ * \return Printed data, NULL on error.
+ */
+static char *
+data_print_annotated(struct lyd_node *data)
+{
+    json_object *data_cjson;
+    enum json_tokener_error tok_err;
+    char *data_json = NULL;
+    struct lyd_node *sibling;
 
-        data_json = strdup(json_object_to_json_string_ext(data_cjson, 0));
-        json_object_put(data_cjson);
+    /* print JSON data */
+    if (lyd_print_mem(&data_json, data, LYD_JSON, LYP_WITHSIBLINGS)) {
+        ERROR("Printing JSON data failed.");
+        return NULL;
+    }
+
+    /* parse JSON data into cjson */
+    pthread_mutex_lock(&json_lock);
+    data_cjson = json_tokener_parse_verbose(data_json, &tok_err);
+    free(data_json);
+    if (!data_cjson) {
+        ERROR("Parsing JSON config failed (%s).", json_tokener_error_desc(tok_err));
         pthread_mutex_unlock(&json_lock);
+        return NULL;
+    }
+
+    /* go simultaneously through both trees and add metadata */
+    LY_TREE_FOR(data, sibling) {
+        node_add_metadata_recursive(sibling, NULL, data_cjson);
+    }
+
+    data_json = strdup(json_object_to_json_string_ext(data_cjson, 0));
+    json_object_put(data_cjson);
+    pthread_mutex_unlock(&json_lock);
+
+    return data_json;
+}
+
+static struct nc_rpc *
+getconfig_rpc_create(NC_DATASTORE source, const char *filter)
+{
+    /* tell server to show all elements even if they have default values */
+#ifdef HAVE_WITHDEFAULTS_TAGGED
+    return nc_rpc_getconfig(source, filter, NC_WD_MODE_ALL_TAG, NC_PARAMTYPE_CONST);
+#else
+    return nc_rpc_getconfig(source, filter, 0, NC_PARAMTYPE_CONST);
+#endif
+}
+
+/**
+ * \brief Perform <get-config> and return the data tree.
+ *
+ * \return NULL on success, json object with error otherwise
+ */
+static json_object *
+netconf_getconfig_tree(unsigned int session_key, NC_DATASTORE source, const char *filter, int strict,
+                       struct lyd_node **data)
+{
+    struct nc_rpc *rpc;
+    json_object *res;
+
+    *data = NULL;
+    rpc = getconfig_rpc_create(source, filter);
+    if (rpc == NULL) {
+        ERROR("mod_netconf: creating rpc request failed");
+        return create_error_reply("Internal: Creating rpc request failed");
+    }
+
+    res = netconf_op(session_key, rpc, strict, data);
+    nc_rpc_free(rpc);
+    return res;
+}
+
+static char *
+netconf_getconfig(unsigned int session_key, NC_DATASTORE source, const char *filter, int strict, json_object **err)
+{
+    char *data_json = NULL;
+    struct lyd_node *data;
+
+    (*err) = netconf_getconfig_tree(session_key, source, filter, strict, &data);
+
+    if (data) {
+        data_json = data_print_annotated(data);
+        if (!data_json) {
+            ERROR("Printing JSON <get-config> data failed.");
+        }
+        lyd_free_withsiblings(data);
     }
 
     return (data_json);
@@ -1605,10 +2523,8 @@ netconf_get(unsigned int session_key, const char* filter, int strict, json_objec
 {
     struct nc_rpc* rpc;
     char* data_json = NULL;
-    json_object *res = NULL, *data_cjson;
-    enum json_tokener_error tok_err;
-    struct session_with_mutex *locked_session;
-    struct lyd_node *data, *sibling, *next;
+    json_object *res = NULL;
+    struct lyd_node *data;
 
     /* create requests */
     rpc = nc_rpc_get(filter, 0, NC_PARAMTYPE_CONST);
@@ -1626,74 +2542,593 @@ netconf_get(unsigned int session_key, const char* filter, int strict, json_objec
     }
 
     if (data) {
-        for (locked_session = netconf_sessions_list;
-             locked_session && (locked_session->session_key != session_key);
-             locked_session = locked_session->next);
-        /* won't fail */
-
-        /* print JSON data */
-        if (lyd_print_mem(&data_json, data, LYD_JSON, LYP_WITHSIBLINGS)) {
+        data_json = data_print_annotated(data);
+        if (!data_json) {
             ERROR("Printing JSON <get> data failed.");
-            lyd_free_withsiblings(data);
-            return NULL;
-        }
-
-        /* parse JSON data into cjson */
-        pthread_mutex_lock(&json_lock);
-        data_cjson = json_tokener_parse_verbose(data_json, &tok_err);
-        if (!data_cjson) {
-            ERROR("Parsing JSON config failed (%s).", json_tokener_error_desc(tok_err));
-            pthread_mutex_unlock(&json_lock);
-            lyd_free_withsiblings(data);
-            free(data_json);
-            return NULL;
         }
-        free(data_json);
-
-        /* go simultaneously through both trees and add metadata */
-        LY_TREE_FOR_SAFE(data, next, sibling) {
-            node_add_metadata_recursive(sibling, NULL, data_cjson);
-            lyd_free(sibling);
-        }
-
-        data_json = strdup(json_object_to_json_string_ext(data_cjson, 0));
-        json_object_put(data_cjson);
-        pthread_mutex_unlock(&json_lock);
+        lyd_free_withsiblings(data);
     }
 
     return data_json;
 }
 
-static json_object *
-netconf_copyconfig(unsigned int session_key, NC_DATASTORE source, NC_DATASTORE target, const char *config,
-                   const char *uri_src, const char *uri_trg)
+/**
+ * \brief Single RFC 6902 JSON Patch operation
+ */
+struct patch_op {
+    const char *op;         /**< "remove", "add" or "replace" */
+    char *path;             /**< JSON Pointer */
+    json_object *value;     /**< value of add and replace */
+};
+
+/* JSON name of a data node, prefixed if its module differs from its parent */
+static char *
+data_node_json_name(const struct lyd_node *node)
 {
-    struct nc_rpc* rpc;
-    json_object *res = NULL;
+    const struct lys_module *module;
+    char *name = NULL;
 
-    /* create requests */
-    rpc = nc_rpc_copy(target, uri_trg, source, (config ? config : uri_src), 0, NC_PARAMTYPE_CONST);
-    if (rpc == NULL) {
-        ERROR("mod_netconf: creating rpc request failed");
-        return create_error_reply("Internal: Creating rpc request failed");
+    module = lyd_node_module(node);
+    if (node->parent && (lyd_node_module(node->parent) == module)) {
+        name = strdup(node->schema->name);
+    } else {
+        asprintf(&name, "%s:%s", module->name, node->schema->name);
     }
+    return name;
+}
 
-    res = netconf_op(session_key, rpc, 0, NULL);
-    nc_rpc_free(rpc);
+/**
+ * \brief Get JSON Pointer of a data node in the JSON printed by libyang.
+ *
+ * \param[in] node Data node.
+ * \param[in] meta 1 to point to the node metadata instead, 2 to point to the array of all
+ * the instances of a list or leaf-list.
+ * \return JSON Pointer.
+ */
+static char *
+data_json_pointer(const struct lyd_node *node, int meta)
+{
+    const struct lyd_node *iter;
+    char *parent_path, *name, *path = NULL;
+    int idx = 0;
+
+    parent_path = node->parent ? data_json_pointer(node->parent, 0) : strdup("");
+    name = data_node_json_name(node);
+
+    if (meta == 1) {
+        asprintf(&path, "%s/$@%s", parent_path, name);
+    } else if ((meta == 0) && (node->schema->nodetype & (LYS_LIST | LYS_LEAFLIST))) {
+        /* position among the instances, they are printed as an array */
+        for (iter = node->parent ? node->parent->child : node; iter->prev->next; iter = iter->prev);
+        for (; iter != node; iter = iter->next) {
+            if (iter->schema == node->schema) {
+                ++idx;
+            }
+        }
+        asprintf(&path, "%s/%s/%d", parent_path, name, idx);
+    } else {
+        asprintf(&path, "%s/%s", parent_path, name);
+    }
 
-    return res;
+    free(parent_path);
+    free(name);
+    return path;
 }
 
+/**
+ * \brief Print a data subtree into JSON, json_lock must be held.
+ *
+ * \param[in] node Data node.
+ * \param[out] meta Metadata of the node, optional.
+ * \return JSON value of the node as it would appear in the whole printed tree.
+ */
 static json_object *
-netconf_editconfig(unsigned int session_key, NC_DATASTORE target, NC_RPC_EDIT_DFLTOP defop,
-                   NC_RPC_EDIT_ERROPT erropt, NC_RPC_EDIT_TESTOPT testopt, const char *config_or_url)
+data_node_json(const struct lyd_node *node, json_object **meta)
 {
-    struct nc_rpc* rpc;
-    json_object *res = NULL;
+    struct lyd_node *dup;
+    json_object *wrapper, *value = NULL, *obj;
+    enum json_tokener_error tok_err;
+    char *str = NULL, *name;
+    const struct lys_module *module;
 
-    /* create requests */
-    rpc = nc_rpc_edit(target, defop, testopt, erropt, config_or_url, NC_PARAMTYPE_CONST);
-    if (rpc == NULL) {
+    /* printed alone so that no siblings are included */
+    dup = lyd_dup(node, 1);
+    if (!dup || lyd_print_mem(&str, dup, LYD_JSON, 0) || !str) {
+        lyd_free(dup);
+        return NULL;
+    }
+    wrapper = json_tokener_parse_verbose(str, &tok_err);
+    free(str);
+    if (!wrapper) {
+        lyd_free(dup);
+        return NULL;
+    }
+    if (meta) {
+        node_add_metadata_recursive(dup, NULL, wrapper);
+    }
+
+    module = lyd_node_module(node);
+    asprintf(&name, "%s:%s", module->name, node->schema->name);
+    if (json_object_object_get_ex(wrapper, name, &obj) == TRUE) {
+        if (node->schema->nodetype & (LYS_LIST | LYS_LEAFLIST)) {
+            obj = json_object_array_get_idx(obj, 0);
+        }
+        value = obj ? json_object_get(obj) : NULL;
+    }
+    if (meta) {
+        *meta = NULL;
+        free(name);
+        asprintf(&name, "$@%s:%s", module->name, node->schema->name);
+        if (json_object_object_get_ex(wrapper, name, &obj) == TRUE) {
+            *meta = json_object_get(obj);
+        }
+    }
+    free(name);
+    json_object_put(wrapper);
+    lyd_free(dup);
+
+    return value;
+}
+
+/* compare JSON Pointers so that array items are ordered by their index */
+static int
+patch_path_cmp(const char *path1, const char *path2)
+{
+    char *end1, *end2;
+    unsigned long idx1, idx2;
+
+    while (*path1 && (*path1 == *path2)) {
+        if (*path1 == '/') {
+            idx1 = strtoul(path1 + 1, &end1, 10);
+            idx2 = strtoul(path2 + 1, &end2, 10);
+            if ((end1 != path1 + 1) && (end2 != path2 + 1) && (!*end1 || (*end1 == '/'))
+                    && (!*end2 || (*end2 == '/'))) {
+                if (idx1 != idx2) {
+                    return (idx1 < idx2) ? -1 : 1;
+                }
+                path1 = end1;
+                path2 = end2;
+                continue;
+            }
+        }
+        ++path1;
+        ++path2;
+    }
+    return (unsigned char)*path1 - (unsigned char)*path2;
+}
+
+static int
+patch_op_cmp(const void *ptr1, const void *ptr2)
+{
+    const struct patch_op *op1 = ptr1, *op2 = ptr2;
+    int rem1 = !strcmp(op1->op, "remove"), rem2 = !strcmp(op2->op, "remove");
+
+    if (rem1 != rem2) {
+        /* removals first */
+        return rem2 - rem1;
+    }
+    if (rem1) {
+        /* from the last item so that the indices of the rest stay valid */
+        return patch_path_cmp(op2->path, op1->path);
+    }
+    /* from the first item so that the item indices match the new tree */
+    return patch_path_cmp(op1->path, op2->path);
+}
+
+static int
+patch_op_add(struct patch_op **ops, int *count, const char *op, char *path, json_object *value)
+{
+    struct patch_op *new_ops;
+
+    new_ops = realloc(*ops, (*count + 1) * sizeof **ops);
+    if (!new_ops || !path) {
+        free(path);
+        json_object_put(value);
+        return -1;
+    }
+    *ops = new_ops;
+    (*ops)[*count].op = op;
+    (*ops)[*count].path = path;
+    (*ops)[*count].value = value;
+    ++(*count);
+    return 0;
+}
+
+/* first instance of the list or leaf-list of a node among its siblings */
+static const struct lyd_node *
+data_first_instance(const struct lyd_node *node)
+{
+    const struct lyd_node *iter;
+
+    for (iter = node->parent ? node->parent->child : node; iter->prev->next; iter = iter->prev);
+    for (; iter->schema != node->schema; iter = iter->next);
+    return iter;
+}
+
+/**
+ * \brief Check whether the other version of a data tree has any instance of the list or leaf-list of a node
+ * in the same parent, otherwise the whole array (and its metadata) is missing in its printed form.
+ */
+static int
+data_instances_exist(const struct lyd_node *node, const struct lyd_node *tree)
+{
+    const struct lyd_node *iter;
+    struct ly_set *set = NULL;
+    char *path;
+    int ret = 0;
+
+    if (node->parent) {
+        path = lyd_path(node->parent);
+        set = (path && tree) ? lyd_find_path(tree, path) : NULL;
+        free(path);
+        iter = (set && set->number) ? set->set.d[0]->child : NULL;
+    } else {
+        for (iter = tree; iter && iter->prev->next; iter = iter->prev);
+    }
+    for (; iter; iter = iter->next) {
+        if (iter->schema == node->schema) {
+            ret = 1;
+            break;
+        }
+    }
+    ly_set_free(set);
+
+    return ret;
+}
+
+/**
+ * \brief Check whether a deleted node is the first instance of a list or leaf-list none of whose
+ * instances remain in the new tree, then the whole array and its metadata are removed.
+ */
+static int
+data_last_instances_deleted(const struct lyd_node *deleted, const struct lyd_node *new)
+{
+    return (data_first_instance(deleted) == deleted) && !data_instances_exist(deleted, new);
+}
+
+/**
+ * \brief Print all the instances of a list or leaf-list into a JSON array, json_lock must be held.
+ *
+ * \param[in] first First instance.
+ * \param[out] meta Metadata of the instances.
+ * \return JSON array as it would appear in the whole printed tree.
+ */
+static json_object *
+data_instances_json(const struct lyd_node *first, json_object **meta)
+{
+    const struct lyd_node *iter;
+    json_object *array, *item;
+
+    *meta = NULL;
+    array = json_object_new_array();
+    for (iter = first; iter; iter = iter->next) {
+        if (iter->schema != first->schema) {
+            continue;
+        }
+        item = data_node_json(iter, (iter == first) ? meta : NULL);
+        if (!item) {
+            json_object_put(array);
+            json_object_put(*meta);
+            *meta = NULL;
+            return NULL;
+        }
+        json_object_array_add(array, item);
+    }
+    return array;
+}
+
+/**
+ * \brief Create RFC 6902 JSON Patch transforming printed \p old data into printed \p new data.
+ *
+ * Only the created nodes are merged with the schema metadata.
+ *
+ * \param[in] old Previous data tree.
+ * \param[in] new Current data tree.
+ * \return Serialized JSON Patch, NULL if it cannot be created (the whole data must be sent).
+ */
+static char *
+data_json_patch(struct lyd_node *old, struct lyd_node *new)
+{
+    struct lyd_difflist *diff;
+    struct patch_op *ops = NULL;
+    json_object *patch, *op_obj, *value, *meta;
+    char *str = NULL;
+    int i, count = 0, ret = 0;
+
+    if (!old && !new) {
+        return strdup("[]");
+    }
+
+    diff = lyd_diff(old, new, 0);
+    if (!diff) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&json_lock);
+    for (i = 0; !ret && (diff->type[i] != LYD_DIFF_END); ++i) {
+        switch (diff->type[i]) {
+        case LYD_DIFF_DELETED:
+            ret = patch_op_add(&ops, &count, "remove", data_json_pointer(diff->first[i], 0), NULL);
+            if (ret) {
+                break;
+            }
+            if (!(diff->first[i]->schema->nodetype & (LYS_LIST | LYS_LEAFLIST))) {
+                /* its metadata are not valid anymore */
+                ret = patch_op_add(&ops, &count, "remove", data_json_pointer(diff->first[i], 1), NULL);
+            } else if (data_last_instances_deleted(diff->first[i], new)) {
+                /* metadata are shared by all the instances, remove them with the last one */
+                ret = patch_op_add(&ops, &count, "remove", data_json_pointer(diff->first[i], 2), NULL);
+                if (!ret) {
+                    ret = patch_op_add(&ops, &count, "remove", data_json_pointer(diff->first[i], 1), NULL);
+                }
+            }
+            break;
+        case LYD_DIFF_CHANGED:
+            value = data_node_json(diff->second[i], NULL);
+            ret = value ? patch_op_add(&ops, &count, "replace", data_json_pointer(diff->second[i], 0), value) : -1;
+            break;
+        case LYD_DIFF_CREATED:
+            if ((diff->second[i]->schema->nodetype & (LYS_LIST | LYS_LEAFLIST))
+                    && !data_instances_exist(diff->second[i], old)) {
+                /* the client has no array to add the item into, it gets the whole array with the first instance */
+                if (data_first_instance(diff->second[i]) != diff->second[i]) {
+                    break;
+                }
+                value = data_instances_json(diff->second[i], &meta);
+                ret = value ? patch_op_add(&ops, &count, "add", data_json_pointer(diff->second[i], 2), value) : -1;
+            } else {
+                value = data_node_json(diff->second[i], &meta);
+                ret = value ? patch_op_add(&ops, &count, "add", data_json_pointer(diff->second[i], 0), value) : -1;
+            }
+            if (!ret && meta) {
+                /* add replaces existing metadata of other list instances */
+                ret = patch_op_add(&ops, &count, "add", data_json_pointer(diff->second[i], 1), meta);
+            }
+            break;
+        default:
+            /* moved user-ordered items, not worth the complexity */
+            ret = -1;
+            break;
+        }
+    }
+    lyd_free_diff(diff);
+
+    if (!ret) {
+        qsort(ops, count, sizeof *ops, patch_op_cmp);
+        patch = json_object_new_array();
+        for (i = 0; i < count; ++i) {
+            op_obj = json_object_new_object();
+            json_object_object_add(op_obj, "op", json_object_new_string(ops[i].op));
+            json_object_object_add(op_obj, "path", json_object_new_string(ops[i].path));
+            if (ops[i].value) {
+                json_object_object_add(op_obj, "value", ops[i].value);
+                ops[i].value = NULL;
+            }
+            json_object_array_add(patch, op_obj);
+        }
+        str = strdup(json_object_to_json_string_ext(patch, 0));
+        json_object_put(patch);
+    }
+    for (i = 0; i < count; ++i) {
+        free(ops[i].path);
+        json_object_put(ops[i].value);
+    }
+    pthread_mutex_unlock(&json_lock);
+    free(ops);
+
+    return str;
+}
+
+/**
+ * \brief Writer of RFC 6242 chunks directly into the client socket.
+ */
+struct chunk_writer {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[STREAM_CHUNK_SIZE];
+};
+
+static int
+send_all(int fd, const char *data, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = send(fd, data, len, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERROR("Sending message failed (%s).", strerror(errno));
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void
+chunk_flush(struct chunk_writer *w)
+{
+    char header[24];
+    int len;
+
+    if (w->failed || !w->len) {
+        w->len = 0;
+        return;
+    }
+
+    len = sprintf(header, "\n#%zu\n", w->len);
+    if (send_all(w->fd, header, len) || send_all(w->fd, w->buf, w->len)) {
+        w->failed = 1;
+    }
+    w->len = 0;
+}
+
+static void
+chunk_write(struct chunk_writer *w, const char *data, size_t len)
+{
+    size_t n;
+
+    while (len && !w->failed) {
+        n = STREAM_CHUNK_SIZE - w->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+        if (w->len == STREAM_CHUNK_SIZE) {
+            chunk_flush(w);
+        }
+    }
+}
+
+/* write data as the content of a JSON string */
+static void
+chunk_write_escaped(struct chunk_writer *w, const char *data, size_t len)
+{
+    char esc[8];
+    size_t i, start;
+
+    for (i = start = 0; i < len; ++i) {
+        if ((data[i] != '"') && (data[i] != '\\') && ((unsigned char)data[i] >= 0x20)) {
+            continue;
+        }
+        chunk_write(w, data + start, i - start);
+        switch (data[i]) {
+        case '"':
+            chunk_write(w, "\\\"", 2);
+            break;
+        case '\\':
+            chunk_write(w, "\\\\", 2);
+            break;
+        case '\n':
+            chunk_write(w, "\\n", 2);
+            break;
+        case '\t':
+            chunk_write(w, "\\t", 2);
+            break;
+        case '\r':
+            chunk_write(w, "\\r", 2);
+            break;
+        default:
+            sprintf(esc, "\\u%04x", (unsigned char)data[i]);
+            chunk_write(w, esc, 6);
+            break;
+        }
+        start = i + 1;
+    }
+    chunk_write(w, data + start, i - start);
+}
+
+/**
+ * \brief Stream data tree with metadata as a JSON string, one top-level subtree at a time.
+ *
+ * Consumes (frees) the data tree.
+ *
+ * \return 0 on success, -1 if printing failed and the string is incomplete.
+ */
+static int
+chunk_write_data(struct chunk_writer *w, struct lyd_node *data)
+{
+    struct lyd_node *run, *last, *iter, *next;
+    json_object *data_cjson;
+    enum json_tokener_error tok_err;
+    char *data_json;
+    int first = 1, ret = 0;
+    size_t len;
+
+    chunk_write(w, "\"{", 2);
+    while (data) {
+        /* print all the instances of a top-level list together, they need not be adjacent */
+        run = data;
+        data = run->next;
+        lyd_unlink(run);
+        last = run;
+        for (iter = data; iter; iter = next) {
+            next = iter->next;
+            if (iter->schema != run->schema) {
+                continue;
+            }
+            if (iter == data) {
+                data = next;
+            }
+            lyd_unlink(iter);
+            lyd_insert_after(last, iter);
+            last = iter;
+        }
+
+        data_json = NULL;
+        if (!ret && lyd_print_mem(&data_json, run, LYD_JSON, LYP_WITHSIBLINGS)) {
+            ERROR("Printing JSON data failed.");
+            ret = -1;
+        }
+        if (!ret) {
+            pthread_mutex_lock(&json_lock);
+            data_cjson = json_tokener_parse_verbose(data_json, &tok_err);
+            free(data_json);
+            data_json = NULL;
+            if (!data_cjson) {
+                ERROR("Parsing JSON data failed (%s).", json_tokener_error_desc(tok_err));
+                ret = -1;
+            } else {
+                node_add_metadata_recursive(run, NULL, data_cjson);
+                data_json = strdup(json_object_to_json_string_ext(data_cjson, 0));
+                json_object_put(data_cjson);
+            }
+            pthread_mutex_unlock(&json_lock);
+        }
+        /* do not hold json_lock while writing into the socket */
+        if (!ret && data_json && ((len = strlen(data_json)) > 2)) {
+            if (!first) {
+                chunk_write(w, ",", 1);
+            }
+            /* strip the enclosing braces */
+            chunk_write_escaped(w, data_json + 1, len - 2);
+            first = 0;
+        }
+        free(data_json);
+        lyd_free_withsiblings(run);
+    }
+    chunk_write(w, "}\"", 2);
+
+    return ret;
+}
+
+static json_object *
+netconf_copyconfig(unsigned int session_key, NC_DATASTORE source, NC_DATASTORE target, const char *config,
+                   const char *uri_src, const char *uri_trg)
+{
+    struct nc_rpc* rpc;
+    json_object *res = NULL;
+
+    /* create requests */
+    rpc = nc_rpc_copy(target, uri_trg, source, (config ? config : uri_src), 0, NC_PARAMTYPE_CONST);
+    if (rpc == NULL) {
+        ERROR("mod_netconf: creating rpc request failed");
+        return create_error_reply("Internal: Creating rpc request failed");
+    }
+
+    res = netconf_op(session_key, rpc, 0, NULL);
+    nc_rpc_free(rpc);
+
+    return res;
+}
+
+static json_object *
+netconf_editconfig(unsigned int session_key, NC_DATASTORE target, NC_RPC_EDIT_DFLTOP defop,
+                   NC_RPC_EDIT_ERROPT erropt, NC_RPC_EDIT_TESTOPT testopt, const char *config_or_url)
+{
+    struct nc_rpc* rpc;
+    json_object *res = NULL;
+
+    /* create requests */
+    rpc = nc_rpc_edit(target, defop, testopt, erropt, config_or_url, NC_PARAMTYPE_CONST);
+    if (rpc == NULL) {
         ERROR("mod_netconf: creating rpc request failed");
         return create_error_reply("Internal: Creating rpc request failed");
     }
@@ -2006,44 +3441,601 @@ children:
     }
 }
 
-static json_object *
-libyang_query(unsigned int session_key, json_object *filter_array, int load_children)
+/**
+ * \brief FNV-1a hash of a string.
+ */
+static uint32_t
+hash_string(const char *str)
 {
-    int i;
-    const char *filter;
-    const struct lys_node *node = NULL;
-    const struct lys_module *module = NULL;
-    struct session_with_mutex *locked_session;
-    json_object *ret = NULL, *data = NULL, *obj;
+    uint32_t hash = 2166136261u;
 
-    locked_session = session_get_locked(session_key, &ret);
-    if (!locked_session) {
-        ERROR("Locking failed or session not found.");
-        goto finish;
+    for (; *str; ++str) {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    session_user_activity(nc_session_get_username(locked_session->session));
+static int
+schema_id_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-    for (i = 0; i < json_object_array_length(filter_array); ++i) {
-        obj = json_object_array_get_idx(filter_array, i);
-        filter = json_object_get_string(obj);
+/**
+ * \brief Fingerprint of the modules (with revisions and enabled features) in a context.
+ *
+ * 64-bit FNV-1a of the sorted "name@revision[+feature...]" identifiers of all the modules,
+ * so it is independent on the order the modules were loaded in and sessions to devices
+ * with the same schema have the same fingerprint even though they have separate contexts.
+ */
+static uint64_t
+ctx_schema_hash(const struct ly_ctx *ctx)
+{
+    const struct lys_module *module;
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t idx = 0;
+    unsigned int count = 0, size = 0, j;
+    char **ids = NULL, **new_ids, *id, *new_id;
+    const char *p;
+    int i;
 
-        if (filter[0] == '/') {
-            node = ly_ctx_get_node(nc_session_get_ctx(locked_session->session), NULL, filter);
-            if (!node) {
-                ret = create_error_reply("Failed to resolve XPath filter node.");
-                goto finish;
+    while ((module = ly_ctx_get_module_iter(ctx, &idx))) {
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            new_ids = realloc(ids, size * sizeof *ids);
+            if (!new_ids) {
+                goto error;
             }
-        } else {
-            module = ly_ctx_get_module(nc_session_get_ctx(locked_session->session), filter, NULL);
-            if (!module) {
-                ret = create_error_reply("Failed to find model.");
-                goto finish;
+            ids = new_ids;
+        }
+        if (asprintf(&id, "%s@%s%s%s", module->name, module->rev_size ? module->rev[0].date : "",
+                     module->implemented ? " implemented" : "", module->deviated ? " deviated" : "") == -1) {
+            goto error;
+        }
+        for (i = 0; i < module->features_size; ++i) {
+            if (!(module->features[i].flags & LYS_FENABLED)) {
+                continue;
             }
+            if (asprintf(&new_id, "%s+%s", id, module->features[i].name) == -1) {
+                free(id);
+                goto error;
+            }
+            free(id);
+            id = new_id;
         }
+        ids[count++] = id;
+    }
 
-        pthread_mutex_lock(&json_lock);
-        if (!data) {
+    qsort(ids, count, sizeof *ids, schema_id_cmp);
+    for (j = 0; j < count; ++j) {
+        /* including the terminating zero as a separator */
+        p = ids[j];
+        do {
+            hash ^= (unsigned char)*p;
+            hash *= 1099511628211ULL;
+        } while (*(p++));
+        free(ids[j]);
+    }
+    free(ids);
+
+    return hash;
+
+error:
+    ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+    for (j = 0; j < count; ++j) {
+        free(ids[j]);
+    }
+    free(ids);
+    /* unique value, nothing is shared with a session without a fingerprint */
+    return (uint64_t)(uintptr_t)ctx;
+}
+
+/**
+ * \brief Current schema fingerprint of a session, recomputed whenever its context changed.
+ *
+ * \param[in] s Session, it must be locked.
+ */
+static uint64_t
+session_schema_hash(struct session_with_mutex *s)
+{
+    const struct ly_ctx *ctx = nc_session_get_ctx(s->session);
+
+    if (ly_ctx_get_module_set_id(ctx) != s->schema_set_id) {
+        s->schema_set_id = ly_ctx_get_module_set_id(ctx);
+        s->schema_hash = ctx_schema_hash(ctx);
+        /* query results of the previous module set */
+        query_cache_flush_ctx(ctx);
+        DEBUG("Schema of session %u changed.", s->session_key);
+    }
+    return s->schema_hash;
+}
+
+/* query_cache_lock must be held */
+static void
+query_cache_unlink(struct query_cache_entry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        query_cache_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        query_cache_tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/* query_cache_lock must be held */
+static void
+query_cache_free_entry(struct query_cache_entry *entry)
+{
+    query_cache_unlink(entry);
+    query_cache_size -= entry->size;
+    free(entry->filter);
+    free(entry->data);
+    free(entry);
+}
+
+/**
+ * \brief Get a copy of a cached query result and mark it as recently used.
+ *
+ * \return Duplicated result to be freed by the caller, NULL if not cached.
+ */
+static char *
+query_cache_get(const struct ly_ctx *ctx, const char *filter, int load_children)
+{
+    struct query_cache_entry *entry;
+    uint32_t hash;
+    char *data = NULL;
+
+    if (!filter) {
+        return NULL;
+    }
+    hash = hash_string(filter);
+
+    pthread_mutex_lock(&query_cache_lock);
+    for (entry = query_cache_head; entry; entry = entry->next) {
+        if ((entry->ctx == ctx) && (entry->hash == hash) && (entry->load_children == load_children)
+                && !strcmp(entry->filter, filter)) {
+            break;
+        }
+    }
+    if (entry) {
+        /* move to the front */
+        if (entry != query_cache_head) {
+            query_cache_unlink(entry);
+            entry->next = query_cache_head;
+            query_cache_head->prev = entry;
+            query_cache_head = entry;
+        }
+        data = strdup(entry->data);
+    }
+    pthread_mutex_unlock(&query_cache_lock);
+
+    return data;
+}
+
+/**
+ * \brief Store a query result, evicting the least recently used entries if over QUERY_CACHE_SIZE.
+ */
+static void
+query_cache_put(const struct ly_ctx *ctx, const char *filter, int load_children, const char *data)
+{
+    struct query_cache_entry *entry;
+    size_t filter_len, data_len;
+
+    if (!filter || !data) {
+        return;
+    }
+    filter_len = strlen(filter);
+    data_len = strlen(data);
+    if (sizeof *entry + filter_len + data_len + 2 > QUERY_CACHE_SIZE) {
+        /* would never fit */
+        return;
+    }
+
+    entry = calloc(1, sizeof *entry);
+    if (!entry) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return;
+    }
+    entry->ctx = ctx;
+    entry->load_children = load_children;
+    entry->hash = hash_string(filter);
+    entry->filter = strdup(filter);
+    entry->data = strdup(data);
+    entry->size = sizeof *entry + filter_len + data_len + 2;
+    if (!entry->filter || !entry->data) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        free(entry->filter);
+        free(entry->data);
+        free(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&query_cache_lock);
+    while (query_cache_tail && (query_cache_size + entry->size > QUERY_CACHE_SIZE)) {
+        query_cache_free_entry(query_cache_tail);
+    }
+    entry->next = query_cache_head;
+    if (query_cache_head) {
+        query_cache_head->prev = entry;
+    } else {
+        query_cache_tail = entry;
+    }
+    query_cache_head = entry;
+    query_cache_size += entry->size;
+    pthread_mutex_unlock(&query_cache_lock);
+}
+
+/**
+ * \brief Drop all cached query results of a context, must be called before the context is freed.
+ */
+static void
+query_cache_flush_ctx(const struct ly_ctx *ctx)
+{
+    struct query_cache_entry *entry, *next;
+
+    pthread_mutex_lock(&query_cache_lock);
+    for (entry = query_cache_head; entry; entry = next) {
+        next = entry->next;
+        if (entry->ctx == ctx) {
+            query_cache_free_entry(entry);
+        }
+    }
+    pthread_mutex_unlock(&query_cache_lock);
+}
+
+/**
+ * \brief Build the complete metadata of a module, the same as SCH_QUERY with load_children returns.
+ *
+ * The JSON object is private to the calling thread, so json_lock is not held while walking
+ * the module and the precompilation never blocks the request threads.
+ *
+ * \return Serialized metadata, NULL on error.
+ */
+static char *
+schema_bundle_build(const struct lys_module *module)
+{
+    const struct lys_node *node;
+    json_object *data;
+    char *str;
+
+    data = json_object_new_object();
+    if (!data) {
+        return NULL;
+    }
+    node_add_model_metadata(module, data);
+    LY_TREE_FOR(module->data, node) {
+        node_add_children_with_metadata_recursive(node, NULL, data);
+    }
+    str = strdup(json_object_to_json_string(data));
+    json_object_put(data);
+
+    return str;
+}
+
+/**
+ * \brief Get the shared bundle set of a schema, create it if there is none yet.
+ *
+ * \param[in] schema_hash Fingerprint of the session schema.
+ * \param[out] build Set to 1 if the caller is supposed to (continue to) precompile the bundles.
+ * \return Referenced set, NULL on error.
+ */
+static struct schema_bundle_set *
+schema_bundle_acquire(uint64_t schema_hash, int *build)
+{
+    struct schema_bundle_set *set;
+
+    *build = 0;
+    pthread_mutex_lock(&schema_bundles_lock);
+    for (set = schema_bundles; set && (set->schema_hash != schema_hash); set = set->next);
+    if (!set) {
+        set = calloc(1, sizeof *set);
+        if (!set) {
+            pthread_mutex_unlock(&schema_bundles_lock);
+            ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+            return NULL;
+        }
+        set->schema_hash = schema_hash;
+        set->next = schema_bundles;
+        schema_bundles = set;
+    }
+    ++set->refs;
+    if (!set->complete && !set->building) {
+        /* new set or the previous builder was closed before finishing */
+        set->building = 1;
+        *build = 1;
+    }
+    pthread_mutex_unlock(&schema_bundles_lock);
+
+    return set;
+}
+
+/**
+ * \brief Release a bundle set acquired by schema_bundle_acquire(), free it with the last reference.
+ */
+static void
+schema_bundle_release(struct schema_bundle_set *set)
+{
+    struct schema_bundle_set **iter;
+    unsigned int i;
+
+    if (!set) {
+        return;
+    }
+
+    pthread_mutex_lock(&schema_bundles_lock);
+    if (--set->refs) {
+        pthread_mutex_unlock(&schema_bundles_lock);
+        return;
+    }
+    for (iter = &schema_bundles; *iter != set; iter = &(*iter)->next);
+    *iter = set->next;
+    pthread_mutex_unlock(&schema_bundles_lock);
+
+    for (i = 0; i < set->count; ++i) {
+        free(set->bundles[i].module);
+        free(set->bundles[i].data);
+    }
+    free(set->bundles);
+    free(set);
+}
+
+/**
+ * \brief Find a bundle of a module in a set, schema_bundles_lock must be held.
+ */
+static struct schema_bundle *
+schema_bundle_find(struct schema_bundle_set *set, const char *module_name)
+{
+    unsigned int i;
+
+    for (i = 0; i < set->count; ++i) {
+        if (!strcmp(set->bundles[i].module, module_name)) {
+            return &set->bundles[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Thread precompiling (and compressing) metadata bundles of all the modules in a session context.
+ *
+ * Runs with the lowest priority, it is cancelled and joined when the session is being closed.
+ * The bundles are shared by all the sessions with the same schema, modules precompiled
+ * by a previous (closed) builder are skipped.
+ */
+static void *
+schema_bundle_thread(void *arg)
+{
+    struct session_with_mutex *s = (struct session_with_mutex *)arg;
+    struct schema_bundle_set *set = s->bundles;
+    const struct ly_ctx *ctx;
+    const struct lys_module *module;
+    struct schema_bundle *bundles;
+    unsigned char *cdata;
+    uLongf clen;
+    uint32_t idx = 0;
+    char *str;
+    size_t len;
+    int done, complete = 0;
+
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19)) {
+        DEBUG("Lowering schema precompilation thread priority failed (%s).", strerror(errno));
+    }
+
+    ctx = nc_session_get_ctx(s->session);
+    while (!s->bundle_cancel && !isterminated) {
+        if (!(module = ly_ctx_get_module_iter(ctx, &idx))) {
+            complete = 1;
+            break;
+        }
+        if (!module->implemented || (ly_ctx_get_module(ctx, module->name, NULL) != module)) {
+            /* queries would never get this module */
+            continue;
+        }
+
+        pthread_mutex_lock(&schema_bundles_lock);
+        done = (schema_bundle_find(set, module->name) != NULL);
+        pthread_mutex_unlock(&schema_bundles_lock);
+        if (done) {
+            continue;
+        }
+
+        str = schema_bundle_build(module);
+        if (!str) {
+            continue;
+        }
+        len = strlen(str);
+
+        clen = compressBound(len);
+        cdata = malloc(clen);
+        if (!cdata || (compress2(cdata, &clen, (unsigned char *)str, len, Z_BEST_COMPRESSION) != Z_OK)) {
+            ERROR("Compressing metadata of \"%s\" failed.", module->name);
+            free(cdata);
+            free(str);
+            continue;
+        }
+        free(str);
+
+        pthread_mutex_lock(&schema_bundles_lock);
+        bundles = realloc(set->bundles, (set->count + 1) * sizeof *set->bundles);
+        if (!bundles) {
+            pthread_mutex_unlock(&schema_bundles_lock);
+            free(cdata);
+            ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+            break;
+        }
+        set->bundles = bundles;
+        set->bundles[set->count].module = strdup(module->name);
+        set->bundles[set->count].data = cdata;
+        set->bundles[set->count].len = len;
+        set->bundles[set->count].clen = clen;
+        if (!set->bundles[set->count].module) {
+            pthread_mutex_unlock(&schema_bundles_lock);
+            free(cdata);
+            ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+            break;
+        }
+        ++set->count;
+        pthread_mutex_unlock(&schema_bundles_lock);
+
+        DEBUG("Precompiled metadata of \"%s\" (%lu B, %lu B compressed).", module->name, (unsigned long)len,
+              (unsigned long)clen);
+    }
+
+    pthread_mutex_lock(&schema_bundles_lock);
+    set->complete = complete;
+    set->building = 0;
+    pthread_mutex_unlock(&schema_bundles_lock);
+
+    return NULL;
+}
+
+/**
+ * \brief Get a decompressed precompiled bundle of a module.
+ *
+ * \param[in] s Session, the session list must be at least read-locked.
+ * \return Serialized metadata to be freed by the caller, NULL if not precompiled (yet).
+ */
+static char *
+schema_bundle_get(struct session_with_mutex *s, const char *module_name)
+{
+    struct schema_bundle *bundle;
+    unsigned char *cdata = NULL;
+    size_t clen = 0;
+    uLongf len = 0;
+    char *str;
+
+    if (!s->bundles || (s->bundles->schema_hash != s->schema_hash)) {
+        /* the session context changed since connecting */
+        return NULL;
+    }
+
+    pthread_mutex_lock(&schema_bundles_lock);
+    bundle = schema_bundle_find(s->bundles, module_name);
+    if (bundle) {
+        clen = bundle->clen;
+        len = bundle->len;
+        cdata = malloc(clen);
+        if (cdata) {
+            memcpy(cdata, bundle->data, clen);
+        }
+    }
+    pthread_mutex_unlock(&schema_bundles_lock);
+
+    if (!cdata) {
+        return NULL;
+    }
+
+    str = malloc(len + 1);
+    if (!str || (uncompress((unsigned char *)str, &len, cdata, clen) != Z_OK)) {
+        ERROR("Decompressing metadata of \"%s\" failed.", module_name);
+        free(cdata);
+        free(str);
+        return NULL;
+    }
+    free(cdata);
+    str[len] = '\0';
+
+    return str;
+}
+
+static json_object *
+libyang_query(unsigned int session_key, json_object *filter_array, int load_children)
+{
+    int i;
+    const char *filter;
+    char *filter_key = NULL, *cached;
+    const struct lys_node *node = NULL;
+    const struct lys_module *module = NULL;
+    const struct ly_ctx *ctx;
+    struct session_with_mutex *locked_session = NULL;
+    json_object *ret = NULL, *data = NULL, *obj;
+
+    pthread_mutex_lock(&json_lock);
+    filter_key = strdup(json_object_to_json_string(filter_array));
+    pthread_mutex_unlock(&json_lock);
+    if (!filter_key) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        ret = create_error_reply("Memory allocation failed.");
+        goto finish;
+    }
+
+    /* cached results need only the context, so the session itself is not locked */
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        ret = create_error_reply("Locking failed.");
+        goto finish;
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session_key != session_key);
+         locked_session = locked_session->next);
+    if (!locked_session) {
+        DEBUG("UNLOCK rdlock %s", __func__);
+        pthread_rwlock_unlock(&session_lock);
+        ret = create_error_reply("Session not found.");
+        goto finish;
+    }
+    session_user_activity(nc_session_get_username(locked_session->session));
+    ctx = nc_session_get_ctx(locked_session->session);
+    cached = NULL;
+    if (ly_ctx_get_module_set_id(ctx) == locked_session->schema_set_id) {
+        /* otherwise the context changed and the cached results are flushed below */
+        cached = query_cache_get(ctx, filter_key, load_children);
+    }
+    if (!cached && (ly_ctx_get_module_set_id(ctx) == locked_session->schema_set_id) && load_children && (json_object_array_length(filter_array) == 1)) {
+        /* whole module queries may have been precompiled */
+        pthread_mutex_lock(&json_lock);
+        filter = json_object_get_string(json_object_array_get_idx(filter_array, 0));
+        pthread_mutex_unlock(&json_lock);
+        if (filter && (filter[0] != '/') && (cached = schema_bundle_get(locked_session, filter))) {
+            query_cache_put(ctx, filter_key, load_children, cached);
+        }
+    }
+    DEBUG("UNLOCK rdlock %s", __func__);
+    pthread_rwlock_unlock(&session_lock);
+    locked_session = NULL;
+
+    if (cached) {
+        DEBUG("Schema query served from the cache.");
+        ret = create_data_reply(cached);
+        free(cached);
+        goto finish;
+    }
+
+    locked_session = session_get_locked(session_key, &ret);
+    if (!locked_session) {
+        ERROR("Locking failed or session not found.");
+        goto finish;
+    }
+    ctx = nc_session_get_ctx(locked_session->session);
+    session_schema_hash(locked_session);
+
+    for (i = 0; i < json_object_array_length(filter_array); ++i) {
+        obj = json_object_array_get_idx(filter_array, i);
+        filter = json_object_get_string(obj);
+
+        if (filter[0] == '/') {
+            node = ly_ctx_get_node(nc_session_get_ctx(locked_session->session), NULL, filter);
+            if (!node) {
+                ret = create_error_reply("Failed to resolve XPath filter node.");
+                goto finish;
+            }
+        } else {
+            module = ly_ctx_get_module(nc_session_get_ctx(locked_session->session), filter, NULL);
+            if (!module) {
+                ret = create_error_reply("Failed to find model.");
+                goto finish;
+            }
+        }
+
+        pthread_mutex_lock(&json_lock);
+        if (!data) {
             data = json_object_new_object();
         }
 
@@ -2065,13 +4057,21 @@ libyang_query(unsigned int session_key, json_object *filter_array, int load_chil
         pthread_mutex_unlock(&json_lock);
     }
 
+    /* store it while the session is still locked, the context cannot be freed meanwhile */
+    pthread_mutex_lock(&json_lock);
+    query_cache_put(ctx, filter_key, load_children, json_object_to_json_string(data));
+    pthread_mutex_unlock(&json_lock);
+
     ret = create_data_reply(json_object_to_json_string(data));
     json_object_put(data);
     data = NULL;
 
 finish:
     json_object_put(data);
-    session_unlock(locked_session);
+    free(filter_key);
+    if (locked_session) {
+        session_unlock(locked_session);
+    }
     return ret;
 }
 
@@ -2348,16 +4348,250 @@ get_param_string(json_object *data, const char *name)
     return res;
 }
 
-json_object *
-handle_op_connect(json_object *request)
+/**
+ * \brief Conversion of request content (JSON into XML or the merge result) done for a session
+ *
+ * Lives for a single request so that the same content sent to many sessions with the same
+ * schema is parsed and printed only once.
+ */
+struct content_cache {
+    uint64_t schema_hash;   /**< fingerprint of the session schema */
+    int options;            /**< libyang parser options used for the conversion */
+    uint32_t hash;          /**< hash of content */
+    char *content;          /**< original content */
+    char *result;           /**< converted content */
+
+    struct content_cache *next;
+};
+
+static void
+content_cache_free(struct content_cache *cache)
 {
-    char *host = NULL;
+    struct content_cache *next;
+
+    for (; cache; cache = next) {
+        next = cache->next;
+        free(cache->content);
+        free(cache->result);
+        free(cache);
+    }
+}
+
+static const char *
+content_cache_find(struct content_cache *cache, uint64_t schema_hash, int options, const char *content)
+{
+    uint32_t hash;
+
+    hash = hash_string(content);
+    for (; cache; cache = cache->next) {
+        if ((cache->schema_hash == schema_hash) && (cache->options == options) && (cache->hash == hash)
+                && !strcmp(cache->content, content)) {
+            return cache->result;
+        }
+    }
+    return NULL;
+}
+
+static void
+content_cache_add(struct content_cache **cache, uint64_t schema_hash, int options, const char *content, const char *result)
+{
+    struct content_cache *item;
+
+    if (!cache) {
+        return;
+    }
+
+    item = calloc(1, sizeof *item);
+    if (!item) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return;
+    }
+    item->schema_hash = schema_hash;
+    item->options = options;
+    item->hash = hash_string(content);
+    item->content = strdup(content);
+    item->result = strdup(result);
+    if (!item->content || !item->result) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        content_cache_free(item);
+        return;
+    }
+
+    item->next = *cache;
+    *cache = item;
+}
+
+/**
+ * \brief Convert JSON content into XML using the session context.
+ *
+ * \param[in] session_key Session to use the context of.
+ * \param[in] content JSON content.
+ * \param[in] options libyang parser options of the content type.
+ * \param[in] what Content description for error messages.
+ * \param[in,out] cache Conversions of the current request, can be NULL.
+ * \param[out] err Error reply on error.
+ * \return Printed XML content, NULL on error.
+ */
+static char *
+content_json2xml(unsigned int session_key, const char *content, int options, const char *what,
+                 struct content_cache **cache, json_object **err)
+{
+    struct session_with_mutex *locked_session;
+    struct lyd_node *tree;
+    const char *xml;
+    uint64_t schema;
+    char *str = NULL;
+
+    locked_session = session_get_locked(session_key, NULL);
+    if (!locked_session) {
+        *err = create_error_reply("Unknown session or locking failed.");
+        return NULL;
+    }
+    schema = session_schema_hash(locked_session);
+
+    if (cache && (xml = content_cache_find(*cache, schema, options, content))) {
+        session_unlock(locked_session);
+        DEBUG("Reusing %s content converted for another session.", what);
+        return strdup(xml);
+    }
+
+    if (options & LYD_OPT_RPC) {
+        tree = lyd_parse_mem(nc_session_get_ctx(locked_session->session), content, LYD_JSON, options, NULL);
+    } else {
+        tree = lyd_parse_mem(nc_session_get_ctx(locked_session->session), content, LYD_JSON, options);
+    }
+    session_unlock(locked_session);
+
+    if (!tree) {
+        asprintf(&str, "Failed to parse %s content.", what);
+        *err = create_error_reply(str);
+        free(str);
+        return NULL;
+    }
+
+    lyd_print_mem(&str, tree, LYD_XML, LYP_WITHSIBLINGS);
+    lyd_free_withsiblings(tree);
+    if (!str) {
+        asprintf(&str, "Failed to print %s content.", what);
+        *err = create_error_reply(str);
+        free(str);
+        return NULL;
+    }
+
+    content_cache_add(cache, schema, options, content, str);
+    return str;
+}
+
+/**
+ * \brief Check XML content that is passed to the server unchanged.
+ *
+ * \param[in] session_key Session to use the context of.
+ * \param[in] content XML content.
+ * \param[in] options libyang parser options of the content type.
+ * \param[in] validate Validation level - "none", "wellformed" (default) or "schema".
+ * \param[in] what Content description for error messages.
+ * \param[out] err Error reply on error.
+ * \return 0 on success, -1 on error.
+ */
+static int
+content_xml_check(unsigned int session_key, const char *content, int options, const char *validate, const char *what,
+                  json_object **err)
+{
+    struct session_with_mutex *locked_session;
+    struct ly_ctx *ctx;
+    struct lyxml_elem *xml;
+    struct lyd_node *tree;
+    char *str = NULL;
+    int ret = 0;
+
+    if (validate && !strcmp(validate, "none")) {
+        return 0;
+    } else if (validate && strcmp(validate, "wellformed") && strcmp(validate, "schema")) {
+        *err = create_error_reply("Invalid validate parameter.");
+        return -1;
+    }
+
+    locked_session = session_get_locked(session_key, NULL);
+    if (!locked_session) {
+        *err = create_error_reply("Unknown session or locking failed.");
+        return -1;
+    }
+    ctx = nc_session_get_ctx(locked_session->session);
+
+    if (validate && !strcmp(validate, "schema")) {
+        if (options & LYD_OPT_RPC) {
+            tree = lyd_parse_mem(ctx, content, LYD_XML, options, NULL);
+        } else {
+            tree = lyd_parse_mem(ctx, content, LYD_XML, options);
+        }
+        if (!tree && content[0]) {
+            ret = -1;
+        }
+        lyd_free_withsiblings(tree);
+    } else {
+        /* only the XML syntax, no schema lookups */
+        xml = lyxml_parse_mem(ctx, content, LYXML_PARSE_MULTIROOT);
+        if (!xml && content[0]) {
+            ret = -1;
+        }
+        lyxml_free_withsiblings(ctx, xml);
+    }
+    session_unlock(locked_session);
+
+    if (ret) {
+        asprintf(&str, "Failed to parse %s content.", what);
+        *err = create_error_reply(str);
+        free(str);
+    }
+    return ret;
+}
+
+/**
+ * \brief Prepare request content in the format expected by the server.
+ *
+ * \param[in] session_key Session the content is for.
+ * \param[in,out] content Content from the request, replaced with the XML content.
+ * \param[in] format Content format - "json" (default) or "xml".
+ * \param[in] validate Validation level of XML content, see content_xml_check().
+ * \param[in] options libyang parser options of the content type.
+ * \param[in] what Content description for error messages.
+ * \param[in,out] cache Conversions of the current request, can be NULL.
+ * \param[out] err Error reply on error.
+ * \return 0 on success, -1 on error.
+ */
+static int
+content_prepare(unsigned int session_key, char **content, const char *format, const char *validate, int options,
+                const char *what, struct content_cache **cache, json_object **err)
+{
+    char *xml;
+
+    if (format && !strcmp(format, "xml")) {
+        return content_xml_check(session_key, *content, options, validate, what, err);
+    } else if (format && strcmp(format, "json")) {
+        *err = create_error_reply("Invalid format parameter.");
+        return -1;
+    }
+
+    xml = content_json2xml(session_key, *content, options, what, cache, err);
+    if (!xml) {
+        return -1;
+    }
+    free(*content);
+    *content = xml;
+    return 0;
+}
+
+json_object *
+handle_op_connect(json_object *request)
+{
+    char *host = NULL;
     char *port = NULL;
     char *user = NULL;
     char *pass = NULL;
     char *privkey = NULL;
-    json_object *reply = NULL;
+    json_object *reply = NULL, *obj;
     unsigned int session_key = 0;
+    int commit_window = 0, commit_edits = 0;
 
     DEBUG("Request: connect");
     pthread_mutex_lock(&json_lock);
@@ -2367,6 +4601,12 @@ handle_op_connect(json_object *request)
     user = get_param_string(request, "user");
     pass = get_param_string(request, "pass");
     privkey = get_param_string(request, "privatekey");
+    if (json_object_object_get_ex(request, "commit-window", &obj) == TRUE) {
+        commit_window = json_object_get_int(obj);
+    }
+    if (json_object_object_get_ex(request, "commit-edits", &obj) == TRUE) {
+        commit_edits = json_object_get_int(obj);
+    }
 
     pthread_mutex_unlock(&json_lock);
 
@@ -2381,257 +4621,1755 @@ handle_op_connect(json_object *request)
     } else {
         session_key = netconf_connect(host, port, user, pass, privkey);
         DEBUG("Session key: %u", session_key);
+        if (session_key && (commit_window > 0)) {
+            commit_batch_create(session_key, commit_window, (commit_edits > 0) ? commit_edits : 0);
+        }
     }
 
     GETSPEC_ERR_REPLY
 
-    pthread_mutex_lock(&json_lock);
-    if (session_key == 0) {
-        /* negative reply */
-        if (err_reply == NULL) {
-            reply = json_object_new_object();
-            json_object_object_add(reply, "type", json_object_new_int(REPLY_ERROR));
-            json_object_object_add(reply, "error-message", json_object_new_string("Connecting NETCONF server failed."));
-            ERROR("Connection failed.");
-        } else {
-            /* use filled err_reply from libnetconf's callback */
-            reply = err_reply;
-            ERROR("Connect - error from libnetconf's callback.");
+    pthread_mutex_lock(&json_lock);
+    if (session_key == 0) {
+        /* negative reply */
+        if (err_reply == NULL) {
+            reply = json_object_new_object();
+            json_object_object_add(reply, "type", json_object_new_int(REPLY_ERROR));
+            json_object_object_add(reply, "error-message", json_object_new_string("Connecting NETCONF server failed."));
+            ERROR("Connection failed.");
+        } else {
+            /* use filled err_reply from libnetconf's callback */
+            reply = err_reply;
+            ERROR("Connect - error from libnetconf's callback.");
+        }
+    } else {
+        /* positive reply */
+        reply = json_object_new_object();
+        json_object_object_add(reply, "type", json_object_new_int(REPLY_OK));
+        json_object_object_add(reply, "session", json_object_new_int(session_key));
+    }
+    memset(pass, 0, strlen(pass));
+    pthread_mutex_unlock(&json_lock);
+    CHECK_AND_FREE(host);
+    CHECK_AND_FREE(user);
+    CHECK_AND_FREE(port);
+    CHECK_AND_FREE(pass);
+    CHECK_AND_FREE(privkey);
+    return reply;
+}
+
+json_object *
+handle_op_disconnect(json_object *UNUSED(request), unsigned int session_key)
+{
+    json_object *reply = NULL;
+
+    DEBUG("Request: disconnect (session %u)", session_key);
+
+    if (netconf_close(session_key, &reply) != EXIT_SUCCESS) {
+        CHECK_ERR_SET_REPLY_ERR("Get configuration information from device failed.")
+    } else {
+        reply = create_ok_reply();
+    }
+
+    return reply;
+}
+
+static void
+config_cache_free(struct config_cache *cache)
+{
+    struct config_cache *next;
+
+    for (; cache; cache = next) {
+        next = cache->next;
+        free(cache->filter);
+        free(cache->data);
+        free(cache);
+    }
+}
+
+/**
+ * \brief Allocate the slots of a notification ring.
+ *
+ * \return 0 on success, -1 on error.
+ */
+int
+notif_ring_init(struct notif_ring *ring, unsigned int size)
+{
+    ring->slots = calloc(size, sizeof *ring->slots);
+    if (!ring->slots) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return -1;
+    }
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ring->signalled = 0;
+    return 0;
+}
+
+/**
+ * \brief Take a reference of a notification frame.
+ */
+struct notif_frame *
+notif_frame_get(struct notif_frame *frame)
+{
+    __atomic_fetch_add(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+/**
+ * \brief Release a reference of a notification frame, the last one frees it.
+ */
+void
+notif_frame_put(struct notif_frame *frame)
+{
+    if (frame && (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+        free(frame);
+    }
+}
+
+/**
+ * \brief Add a notification, only the producer thread can call it. If the ring is full,
+ * either the oldest or this notification is dropped (NOTIFICATION_DROP_OLDEST).
+ *
+ * \param[in] ring Ring.
+ * \param[in] eventtime Event time of the notification.
+ * \param[in] frame Frame of the notification, the reference is released when dropped or removed.
+ */
+void
+notif_ring_push(struct notif_ring *ring, time_t eventtime, struct notif_frame *frame)
+{
+    notification_t *slot;
+    unsigned int head, tail;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (head - tail >= ring->size) {
+#if NOTIFICATION_DROP_OLDEST
+        /* remove the oldest notification unless the consumer removes it first */
+        if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            notif_frame_put(ring->slots[tail % ring->size].frame);
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            break;
+        }
+#else
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        notif_frame_put(frame);
+        return;
+#endif
+    }
+
+    slot = &ring->slots[head % ring->size];
+    slot->eventtime = eventtime;
+    slot->frame = frame;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Remove the oldest notification, only the consumer thread can call it.
+ *
+ * \param[in] ring Ring.
+ * \param[out] notif Removed notification, the caller releases its frame.
+ * \return 0 on success, 1 if the ring is empty.
+ */
+int
+notif_ring_pop(struct notif_ring *ring, notification_t *notif)
+{
+    unsigned int head, tail;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    do {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return 1;
+        }
+        /* the slot is ours (and valid) only if the producer did not drop it meanwhile */
+        *notif = ring->slots[tail % ring->size];
+    } while (!__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return 0;
+}
+
+/**
+ * \brief Free all the notifications and the slots of a ring, neither thread can use it anymore.
+ */
+void
+notif_ring_clean(struct notif_ring *ring)
+{
+    notification_t notif;
+
+    if (!ring->slots) {
+        return;
+    }
+    while (!notif_ring_pop(ring, &notif)) {
+        notif_frame_put(notif.frame);
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/**
+ * \brief Drop cached <get-config> replies of a session whose configuration may have changed.
+ *
+ * \param[in] locked_session Session, session_lock must be held.
+ */
+void
+session_config_changed(struct session_with_mutex *locked_session)
+{
+    int i;
+
+    pthread_mutex_lock(&locked_session->cache_lock);
+    ++locked_session->config_gen;
+    config_cache_free(locked_session->config_cache);
+    locked_session->config_cache = NULL;
+    for (i = 0; i < 3; ++i) {
+        lyd_free_withsiblings(locked_session->config_trees[i].tree);
+        locked_session->config_trees[i].tree = NULL;
+    }
+    pthread_mutex_unlock(&locked_session->cache_lock);
+}
+
+static void
+config_changed(unsigned int session_key)
+{
+    struct session_with_mutex *locked_session;
+
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        return;
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session_key != session_key);
+         locked_session = locked_session->next);
+    if (locked_session) {
+        session_config_changed(locked_session);
+    }
+    DEBUG("UNLOCK rdlock %s", __func__);
+    pthread_rwlock_unlock(&session_lock);
+}
+
+/**
+ * \brief Get cached <get-config> reply.
+ *
+ * \param[in] session_key Session.
+ * \param[in] source Datastore.
+ * \param[in] filter Filter, can be NULL.
+ * \param[in] strict Strict parameter.
+ * \param[in] lookup Whether to look for the reply or only get \p gen.
+ * \param[out] gen Configuration generation to pass to config_cache_put().
+ * \return Cached reply data, NULL if not cached.
+ */
+static char *
+config_cache_get(unsigned int session_key, NC_DATASTORE source, const char *filter, int strict, int lookup,
+                 unsigned int *gen)
+{
+    struct session_with_mutex *locked_session;
+    struct config_cache *item, *prev;
+    time_t now = time(NULL);
+    char *data = NULL;
+
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        return NULL;
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session_key != session_key);
+         locked_session = locked_session->next);
+    if (!locked_session) {
+        goto unlock;
+    }
+
+    pthread_mutex_lock(&locked_session->cache_lock);
+    *gen = locked_session->config_gen;
+    for (prev = NULL, item = locked_session->config_cache; item; prev = item, item = item->next) {
+        if (item->stored + CONFIG_CACHE_TTL <= now) {
+            /* the rest is older */
+            if (prev) {
+                prev->next = NULL;
+            } else {
+                locked_session->config_cache = NULL;
+            }
+            config_cache_free(item);
+            break;
+        }
+        if (lookup && (item->source == source) && (item->strict == strict)
+                && ((!item->filter && !filter) || (item->filter && filter && !strcmp(item->filter, filter)))) {
+            data = strdup(item->data);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&locked_session->cache_lock);
+
+unlock:
+    DEBUG("UNLOCK rdlock %s", __func__);
+    pthread_rwlock_unlock(&session_lock);
+    return data;
+}
+
+/**
+ * \brief Store <get-config> reply unless the configuration changed since \p gen was obtained.
+ */
+static void
+config_cache_put(unsigned int session_key, NC_DATASTORE source, const char *filter, int strict, unsigned int gen,
+                 const char *data)
+{
+    struct session_with_mutex *locked_session;
+    struct config_cache *item, *prev, *new_item;
+    int count;
+
+    new_item = calloc(1, sizeof *new_item);
+    if (!new_item) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return;
+    }
+    new_item->source = source;
+    new_item->strict = strict;
+    new_item->filter = filter ? strdup(filter) : NULL;
+    new_item->data = strdup(data);
+    new_item->stored = time(NULL);
+
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        config_cache_free(new_item);
+        return;
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session_key != session_key);
+         locked_session = locked_session->next);
+    if (!locked_session) {
+        config_cache_free(new_item);
+        goto unlock;
+    }
+
+    pthread_mutex_lock(&locked_session->cache_lock);
+    if (locked_session->config_gen != gen) {
+        /* the reply may be outdated */
+        config_cache_free(new_item);
+    } else {
+        /* newest first, remove the previous reply for the same request and the oldest ones */
+        new_item->next = locked_session->config_cache;
+        locked_session->config_cache = new_item;
+        for (count = 1, prev = new_item, item = new_item->next; item; item = prev->next) {
+            if ((count == CONFIG_CACHE_COUNT) || ((item->source == source) && (item->strict == strict)
+                    && ((!item->filter && !filter) || (item->filter && filter && !strcmp(item->filter, filter))))) {
+                prev->next = item->next;
+                item->next = NULL;
+                config_cache_free(item);
+            } else {
+                ++count;
+                prev = item;
+            }
+        }
+    }
+    pthread_mutex_unlock(&locked_session->cache_lock);
+
+unlock:
+    DEBUG("UNLOCK rdlock %s", __func__);
+    pthread_rwlock_unlock(&session_lock);
+}
+
+/**
+ * \brief Get configuration data tree of a datastore, cached or freshly received.
+ *
+ * \param[in] session_key Session.
+ * \param[in] source Datastore (running, startup or candidate).
+ * \param[in] use_cache Whether a cached copy can be used.
+ * \param[out] tree Data tree owned by the caller, NULL if empty.
+ * \return NULL on success, json object with error otherwise
+ */
+static json_object *
+config_tree_get(unsigned int session_key, NC_DATASTORE source, int use_cache, struct lyd_node **tree)
+{
+    struct session_with_mutex *locked_session;
+    struct config_tree *cached;
+    json_object *reply;
+    unsigned int gen;
+    int found = 0;
+
+    *tree = NULL;
+    if ((source < NC_DATASTORE_RUNNING) || (source > NC_DATASTORE_CANDIDATE)) {
+        return create_error_reply("Invalid source repository type requested.");
+    }
+
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        return create_error_reply("Locking failed.");
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session_key != session_key);
+         locked_session = locked_session->next);
+    if (!locked_session) {
+        pthread_rwlock_unlock(&session_lock);
+        return create_error_reply("Session not found.");
+    }
+    pthread_mutex_lock(&locked_session->cache_lock);
+    gen = locked_session->config_gen;
+    cached = &locked_session->config_trees[source - NC_DATASTORE_RUNNING];
+    if (use_cache && CONFIG_CACHE_TTL && (cached->gen == gen) && (cached->stored + CONFIG_CACHE_TTL > time(NULL))
+            && cached->tree) {
+        *tree = lyd_dup_withsiblings(cached->tree, 1);
+        found = (*tree != NULL);
+    }
+    pthread_mutex_unlock(&locked_session->cache_lock);
+    DEBUG("UNLOCK rdlock %s", __func__);
+    pthread_rwlock_unlock(&session_lock);
+
+    if (found) {
+        DEBUG("Configuration data tree served from the cache.");
+        return NULL;
+    }
+
+    reply = netconf_getconfig_tree(session_key, source, NULL, 0, tree);
+    if (reply || !*tree || !CONFIG_CACHE_TTL) {
+        return reply;
+    }
+
+    /* store a copy */
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        return NULL;
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session_key != session_key);
+         locked_session = locked_session->next);
+    if (locked_session) {
+        pthread_mutex_lock(&locked_session->cache_lock);
+        if (locked_session->config_gen == gen) {
+            cached = &locked_session->config_trees[source - NC_DATASTORE_RUNNING];
+            lyd_free_withsiblings(cached->tree);
+            cached->tree = lyd_dup_withsiblings(*tree, 1);
+            cached->gen = gen;
+            cached->stored = time(NULL);
+        }
+        pthread_mutex_unlock(&locked_session->cache_lock);
+    }
+    DEBUG("UNLOCK rdlock %s", __func__);
+    pthread_rwlock_unlock(&session_lock);
+
+    return NULL;
+}
+
+/**
+ * \brief Pending <get> or <get-config> whose reply is shared by all the identical requests
+ */
+struct read_request {
+    unsigned int session_key;
+    int operation;          /**< MSG_GET or MSG_GETCONFIG */
+    NC_DATASTORE source;
+    int strict;
+    char *filter;
+    unsigned int gen;       /**< configuration generation when the request was sent */
+
+    char done;
+    unsigned int refs;
+    char *data;             /**< reply data on success */
+    struct shared_json *json; /**< data serialized as a JSON string on success, can be NULL */
+    char *err;              /**< serialized error reply on error */
+    struct read_request *next;
+};
+
+/**
+ * \brief Reference counted serialized JSON value printed as it is into several replies
+ */
+struct shared_json {
+    unsigned int refs;      /**< atomic */
+    char str[];
+};
+
+static struct read_request *read_requests;
+
+/**
+ * \brief Serialize a string as a JSON value once for all the replies it is used in.
+ *
+ * \return Shared value with one reference, NULL on error.
+ */
+static struct shared_json *
+shared_json_create(const char *data)
+{
+    struct shared_json *sj = NULL;
+    json_object *obj;
+    const char *str;
+    size_t len;
+
+    pthread_mutex_lock(&json_lock);
+    obj = json_object_new_string(data);
+    if (obj && (str = json_object_to_json_string(obj))) {
+        len = strlen(str);
+        sj = malloc(sizeof *sj + len + 1);
+        if (sj) {
+            sj->refs = 1;
+            memcpy(sj->str, str, len + 1);
+        }
+    }
+    json_object_put(obj);
+    pthread_mutex_unlock(&json_lock);
+
+    if (!sj) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+    }
+    return sj;
+}
+
+static void
+shared_json_put(struct shared_json *sj)
+{
+    if (sj && !__atomic_sub_fetch(&sj->refs, 1, __ATOMIC_ACQ_REL)) {
+        free(sj);
+    }
+}
+
+/* json-c user_delete callback, userdata is the str member */
+static void
+shared_json_delete(json_object *UNUSED(jso), void *userdata)
+{
+    shared_json_put((struct shared_json *)((char *)userdata - offsetof(struct shared_json, str)));
+}
+
+/**
+ * \brief Create data reply of a shared read request.
+ *
+ * The "data" value is printed from the buffer shared by all the requests that joined the RPC,
+ * so the (possibly large) data are serialized only once. Its json_object_get_string() is empty.
+ */
+static json_object *
+read_request_reply(struct read_request *req)
+{
+    json_object *reply, *data;
+
+    if (!req->json) {
+        return create_data_reply(req->data);
+    }
+
+    __atomic_add_fetch(&req->json->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&json_lock);
+    reply = json_object_new_object();
+    json_object_object_add(reply, "type", json_object_new_int(REPLY_DATA));
+    data = json_object_new_string("");
+    json_object_set_serializer(data, json_object_userdata_to_json_string, req->json->str, shared_json_delete);
+    json_object_object_add(reply, "data", data);
+    pthread_mutex_unlock(&json_lock);
+
+    return reply;
+}
+
+static void
+read_request_release(struct read_request *req)
+{
+    pthread_mutex_lock(&read_requests_lock);
+    if (--req->refs) {
+        req = NULL;
+    }
+    pthread_mutex_unlock(&read_requests_lock);
+
+    if (req) {
+        free(req->filter);
+        free(req->data);
+        shared_json_put(req->json);
+        free(req->err);
+        free(req);
+    }
+}
+
+/**
+ * \brief Perform <get> or <get-config>, identical concurrent requests share a single RPC.
+ *
+ * \param[in] operation MSG_GET or MSG_GETCONFIG.
+ * \param[in] session_key Session.
+ * \param[in] source Datastore of <get-config>.
+ * \param[in] filter Filter, can be NULL.
+ * \param[in] strict Strict parameter.
+ * \param[in] gen Configuration generation, only requests sent in the same generation are shared.
+ * \param[out] req Reference to release using read_request_release() after the data are used.
+ * \param[out] joined Set if the RPC of another request was used.
+ * \param[out] err Error reply on error.
+ * \return Reply data, NULL on error.
+ */
+static const char *
+netconf_read_shared(int operation, unsigned int session_key, NC_DATASTORE source, const char *filter, int strict,
+                    unsigned int gen, struct read_request **req, int *joined, json_object **err)
+{
+    struct read_request *r, *prev;
+    json_object *reply = NULL;
+    enum json_tokener_error tok_err;
+    struct timespec limit;
+
+    pthread_mutex_lock(&read_requests_lock);
+    for (r = read_requests; r; r = r->next) {
+        if ((r->session_key == session_key) && (r->operation == operation) && (r->gen == gen)
+                && ((operation == MSG_GET) || (r->source == source)) && (r->strict == strict)
+                && ((!r->filter && !filter) || (r->filter && filter && !strcmp(r->filter, filter)))) {
+            break;
+        }
+    }
+
+    if (r) {
+        /* wait for the reply of the identical request */
+        DEBUG("Joining a pending identical request (session %u).", session_key);
+        ++r->refs;
+        request_deadline(RPC_TIMEOUT_READ, &limit);
+        while (!r->done && !request_cond_wait(&read_requests_cond, &read_requests_lock, &limit));
+        pthread_mutex_unlock(&read_requests_lock);
+
+        *joined = 1;
+        if (!r->done) {
+            /* the pending request goes on for the others */
+            read_request_release(r);
+            *err = request_abandoned_reply();
+            *req = NULL;
+            return NULL;
+        }
+        if (r->data) {
+            *req = r;
+            return r->data;
+        }
+
+        pthread_mutex_lock(&json_lock);
+        *err = json_tokener_parse_verbose(r->err, &tok_err);
+        pthread_mutex_unlock(&json_lock);
+        if (!*err) {
+            *err = create_error_reply("Operation failed.");
+        }
+        read_request_release(r);
+        *req = NULL;
+        return NULL;
+    }
+
+    r = calloc(1, sizeof *r);
+    if (!r) {
+        pthread_mutex_unlock(&read_requests_lock);
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        *err = create_error_reply("Memory allocation failed.");
+        return NULL;
+    }
+    r->session_key = session_key;
+    r->operation = operation;
+    r->source = source;
+    r->strict = strict;
+    r->filter = filter ? strdup(filter) : NULL;
+    r->gen = gen;
+    r->refs = 1;
+    r->next = read_requests;
+    read_requests = r;
+    pthread_mutex_unlock(&read_requests_lock);
+
+    *joined = 0;
+    if (operation == MSG_GET) {
+        r->data = netconf_get(session_key, filter, strict, &reply);
+        if (!r->data) {
+            CHECK_ERR_SET_REPLY_ERR("Get information failed.")
+        }
+    } else {
+        r->data = netconf_getconfig(session_key, source, filter, strict, &reply);
+        if (!r->data) {
+            CHECK_ERR_SET_REPLY_ERR("Get configuration operation failed.")
+        }
+    }
+    if (!r->data) {
+        pthread_mutex_lock(&json_lock);
+        r->err = strdup(json_object_to_json_string(reply));
+        pthread_mutex_unlock(&json_lock);
+    } else {
+        /* escaped once for all the replies */
+        r->json = shared_json_create(r->data);
+    }
+
+    /* wake the joined requests, following requests will send their own RPC */
+    pthread_mutex_lock(&read_requests_lock);
+    r->done = 1;
+    if (read_requests == r) {
+        read_requests = r->next;
+    } else {
+        for (prev = read_requests; prev->next != r; prev = prev->next);
+        prev->next = r->next;
+    }
+    pthread_cond_broadcast(&read_requests_cond);
+    pthread_mutex_unlock(&read_requests_lock);
+
+    if (!r->data) {
+        *err = reply;
+        read_request_release(r);
+        *req = NULL;
+        return NULL;
+    }
+    *req = r;
+    return r->data;
+}
+
+/* last node of a data path, predicates of the preceding nodes can contain any characters */
+static const char *
+path_last_node(const char *path)
+{
+    const char *last = path;
+    char quote = 0;
+    int depth = 0;
+
+    for (; *path; ++path) {
+        if (quote) {
+            if (*path == quote) {
+                quote = 0;
+            }
+        } else if ((*path == '\'') || (*path == '"')) {
+            quote = *path;
+        } else if (*path == '[') {
+            ++depth;
+        } else if (*path == ']') {
+            --depth;
+        } else if ((*path == '/') && !depth) {
+            last = path + 1;
+        }
+    }
+    return last;
+}
+
+/* XPath predicates with the keys of a list instance, the cursor of the following page */
+static char *
+list_instance_cursor(const struct lyd_node *node)
+{
+    const struct lyd_node *child;
+    const char *value;
+    char *cursor = NULL, *tmp;
+    int i;
+
+    cursor = strdup("");
+    for (i = 0, child = node->child; cursor && child && (i < ((struct lys_node_list *)node->schema)->keys_size);
+            ++i, child = child->next) {
+        value = ((struct lyd_node_leaf_list *)child)->value_str;
+        tmp = cursor;
+        if (asprintf(&cursor, strchr(value, '\'') ? "%s[%s=\"%s\"]" : "%s[%s='%s']", tmp, child->schema->name,
+                     value) == -1) {
+            cursor = NULL;
+        }
+        free(tmp);
+    }
+    return cursor;
+}
+
+/**
+ * \brief Get one page of the instances of a list.
+ *
+ * Only the page is requested from the device using an XPath filter, one more instance is requested
+ * to learn whether there are further pages. The instances are counted per parent, so the path
+ * must select the instances of a single parent, otherwise an error is returned.
+ *
+ * \param[in] session_key Session.
+ * \param[in] list Data path of the list without the predicates of the list itself.
+ * \param[in] where XPath predicate the instances must satisfy, can be NULL.
+ * \param[in] offset Number of instances to skip, used if there is no cursor.
+ * \param[in] cursor Key predicates of the instance preceding the page, can be NULL.
+ * \param[in] limit Maximum number of instances.
+ * \param[in] strict Strict parameter.
+ * \return Data reply with the page or error reply.
+ */
+static json_object *
+get_page(unsigned int session_key, const char *list, const char *where, unsigned int offset, const char *cursor,
+         unsigned int limit, int strict)
+{
+    struct session_with_mutex *locked_session;
+    struct nc_rpc *rpc;
+    struct lyd_node *data = NULL;
+    struct ly_set *set = NULL;
+    json_object *reply = NULL;
+    char *xpath = NULL, *cond = NULL, *str = NULL, *next = NULL;
+    int xpath_support;
+    unsigned int i;
+
+    locked_session = session_get_locked(session_key, &reply);
+    if (!locked_session) {
+        return reply ? reply : create_error_reply("Invalid session identifier.");
+    }
+    xpath_support = (nc_session_cpblt(locked_session->session, "urn:ietf:params:netconf:capability:xpath:1.0") != NULL);
+    session_unlock(locked_session);
+    if (!xpath_support) {
+        return create_error_reply("Paged get requires the :xpath capability of the device.");
+    }
+
+    if (where) {
+        asprintf(&cond, "[%s]", where);
+    }
+    if (cursor) {
+        asprintf(&xpath, "%s%s/following-sibling::%s%s[position() <= %u]", list, cursor, path_last_node(list),
+                 cond ? cond : "", limit + 1);
+    } else {
+        asprintf(&xpath, "%s%s[position() > %u and position() <= %u]", list, cond ? cond : "", offset,
+                 offset + limit + 1);
+    }
+    free(cond);
+    if (!xpath) {
+        return create_error_reply("Memory allocation failed.");
+    }
+    DEBUG("Paged get filter: %s", xpath);
+
+    rpc = nc_rpc_get(xpath, 0, NC_PARAMTYPE_CONST);
+    if (!rpc) {
+        free(xpath);
+        return create_error_reply("Creation of RPC request failed.");
+    }
+    reply = netconf_op(session_key, rpc, strict, &data);
+    nc_rpc_free(rpc);
+    free(xpath);
+    if (reply) {
+        lyd_free_withsiblings(data);
+        return reply;
+    }
+    CHECK_ERR_SET_REPLY
+    if (reply) {
+        lyd_free_withsiblings(data);
+        return reply;
+    }
+
+    set = data ? lyd_find_path(data, list) : NULL;
+    for (i = 1; set && (i < set->number); ++i) {
+        if (set->set.d[i]->parent != set->set.d[0]->parent) {
+            /* position() and following-sibling are evaluated per parent, the page would be wrong */
+            ly_set_free(set);
+            lyd_free_withsiblings(data);
+            return create_error_reply("The list path selects instances in several parents, add predicates to the path.");
+        }
+    }
+
+    /* remove the extra instance */
+    if (set && (set->number > limit)) {
+        next = list_instance_cursor(set->set.d[limit - 1]);
+        while (set->number > limit) {
+            lyd_free(set->set.d[--set->number]);
+        }
+    }
+
+    str = data ? data_print_annotated(data) : NULL;
+    if (data && !str) {
+        reply = create_error_reply("Printing JSON data failed.");
+    } else {
+        reply = create_data_reply(str ? str : "{}");
+        pthread_mutex_lock(&json_lock);
+        json_object_object_add(reply, "count", json_object_new_int(set ? set->number : 0));
+        json_object_object_add(reply, "more", json_object_new_boolean(next != NULL));
+        if (next) {
+            json_object_object_add(reply, "cursor", json_object_new_string(next));
+        }
+        pthread_mutex_unlock(&json_lock);
+    }
+
+    ly_set_free(set);
+    lyd_free_withsiblings(data);
+    free(str);
+    free(next);
+    return reply;
+}
+
+json_object *
+handle_op_get(json_object *request, unsigned int session_key)
+{
+    char *filter = NULL, *list = NULL, *cursor = NULL, *where = NULL;
+    const char *data;
+    struct read_request *shared;
+    json_object *reply = NULL, *obj;
+    int strict, joined, offset = 0, limit = 0;
+    unsigned int gen = 0;
+
+    DEBUG("Request: get (session %u)", session_key);
+
+    pthread_mutex_lock(&json_lock);
+    filter = get_param_string(request, "filter");
+    list = get_param_string(request, "list");
+    cursor = get_param_string(request, "cursor");
+    where = get_param_string(request, "where");
+    if (json_object_object_get_ex(request, "offset", &obj) == TRUE) {
+        offset = json_object_get_int(obj);
+    }
+    if (json_object_object_get_ex(request, "limit", &obj) == TRUE) {
+        limit = json_object_get_int(obj);
+    }
+    if (json_object_object_get_ex(request, "strict", &obj) == FALSE) {
+        pthread_mutex_unlock(&json_lock);
+        reply = create_error_reply("Missing strict parameter.");
+        goto finalize;
+    }
+    strict = json_object_get_boolean(obj);
+    pthread_mutex_unlock(&json_lock);
+
+    if (list) {
+        /* paged get, "where" restricts the list instances */
+        if ((limit < 1) || (offset < 0) || (cursor && offset)) {
+            reply = create_error_reply("Invalid limit, offset or cursor parameter.");
+        } else if (filter) {
+            reply = create_error_reply("Paged get does not support the filter parameter, use where.");
+        } else {
+            reply = get_page(session_key, list, where, offset, cursor, limit, strict);
+        }
+        goto finalize;
+    }
+
+    /* only the configuration generation */
+    config_cache_get(session_key, NC_DATASTORE_RUNNING, NULL, 0, 0, &gen);
+
+    data = netconf_read_shared(MSG_GET, session_key, NC_DATASTORE_RUNNING, filter, strict, gen, &shared, &joined,
+                               &reply);
+    if (data == NULL) {
+        CHECK_ERR_SET_REPLY_ERR("Get information failed.")
+    } else {
+        reply = read_request_reply(shared);
+        read_request_release(shared);
+    }
+
+finalize:
+    CHECK_AND_FREE(filter);
+    CHECK_AND_FREE(list);
+    CHECK_AND_FREE(cursor);
+    CHECK_AND_FREE(where);
+    return reply;
+}
+
+/**
+ * \brief Perform <get-config> and reply with the changes since the version the client has.
+ *
+ * \param[in] session_key Session.
+ * \param[in] source Datastore.
+ * \param[in] filter Filter, can be NULL.
+ * \param[in] strict Strict parameter.
+ * \param[in] version Version token of the client, the whole data are sent if it is not the last one.
+ * \return Reply with the data or JSON Patch and the new version token.
+ */
+static json_object *
+getconfig_delta(unsigned int session_key, NC_DATASTORE source, const char *filter, int strict, const char *version)
+{
+    struct session_with_mutex *locked_session;
+    struct lyd_node *data, *old = NULL;
+    json_object *reply;
+    char *str = NULL, *end;
+    unsigned long client_version;
+    unsigned int new_version = 0;
+    int patch = 0;
+
+    reply = netconf_getconfig_tree(session_key, source, filter, strict, &data);
+    if (reply) {
+        lyd_free_withsiblings(data);
+        return reply;
+    }
+
+    client_version = strtoul(version, &end, 10);
+    if (*end || !version[0]) {
+        client_version = 0;
+    }
+
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        lyd_free_withsiblings(data);
+        return create_error_reply("Locking failed.");
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session_key != session_key);
+         locked_session = locked_session->next);
+    if (!locked_session) {
+        pthread_rwlock_unlock(&session_lock);
+        lyd_free_withsiblings(data);
+        return create_error_reply("Session not found.");
+    }
+
+    pthread_mutex_lock(&locked_session->cache_lock);
+    if (client_version && (client_version == locked_session->delta_version)
+            && (locked_session->delta_source == source) && (locked_session->delta_strict == strict)
+            && ((!locked_session->delta_filter && !filter)
+                || (locked_session->delta_filter && filter && !strcmp(locked_session->delta_filter, filter)))) {
+        /* diffed without the locks, the version is not valid for any other request meanwhile */
+        old = locked_session->delta_tree;
+        locked_session->delta_tree = NULL;
+        ++locked_session->delta_version;
+        patch = 1;
+    }
+    pthread_mutex_unlock(&locked_session->cache_lock);
+    DEBUG("UNLOCK rdlock %s", __func__);
+    pthread_rwlock_unlock(&session_lock);
+
+    if (patch) {
+        str = data_json_patch(old, data);
+        patch = (str != NULL);
+    }
+    if (!str) {
+        str = data ? data_print_annotated(data) : strdup("{}");
+    }
+    lyd_free_withsiblings(old);
+    old = NULL;
+    if (!str) {
+        lyd_free_withsiblings(data);
+        return create_error_reply("Printing configuration data failed.");
+    }
+
+    /* remember the tree the client now has */
+    DEBUG("LOCK rdlock %s", __func__);
+    if (pthread_rwlock_rdlock(&session_lock) == 0) {
+        for (locked_session = netconf_sessions_list;
+             locked_session && (locked_session->session_key != session_key);
+             locked_session = locked_session->next);
+        if (locked_session) {
+            pthread_mutex_lock(&locked_session->cache_lock);
+            old = locked_session->delta_tree;
+            locked_session->delta_tree = data;
+            data = NULL;
+            locked_session->delta_source = source;
+            locked_session->delta_strict = strict;
+            free(locked_session->delta_filter);
+            locked_session->delta_filter = filter ? strdup(filter) : NULL;
+            new_version = ++locked_session->delta_version;
+            if (!new_version) {
+                /* 0 is never valid */
+                new_version = ++locked_session->delta_version;
+            }
+            pthread_mutex_unlock(&locked_session->cache_lock);
+        }
+        DEBUG("UNLOCK rdlock %s", __func__);
+        pthread_rwlock_unlock(&session_lock);
+    }
+    lyd_free_withsiblings(old);
+    lyd_free_withsiblings(data);
+
+    DEBUG("Sending %s of the configuration.", patch ? "changes" : "whole data");
+    pthread_mutex_lock(&json_lock);
+    reply = json_object_new_object();
+    json_object_object_add(reply, "type", json_object_new_int(REPLY_DATA));
+    json_object_object_add(reply, patch ? "patch" : "data", json_object_new_string(str));
+    free(str);
+    asprintf(&str, "%u", new_version);
+    json_object_object_add(reply, "version", json_object_new_string(str));
+    pthread_mutex_unlock(&json_lock);
+    free(str);
+
+    return reply;
+}
+
+json_object *
+handle_op_getconfig(json_object *request, unsigned int session_key)
+{
+    NC_DATASTORE ds_type_s = -1;
+    char *filter = NULL;
+    char *data = NULL;
+    const char *shared_data;
+    char *source = NULL;
+    char *version = NULL;
+    struct read_request *shared;
+    json_object *reply = NULL, *obj;
+    int strict, use_cache = 1, joined;
+    unsigned int gen = 0;
+
+    DEBUG("Request: get-config (session %u)", session_key);
+
+    pthread_mutex_lock(&json_lock);
+    filter = get_param_string(request, "filter");
+    source = get_param_string(request, "source");
+    if (source != NULL) {
+        ds_type_s = parse_datastore(source);
+    }
+    if (json_object_object_get_ex(request, "strict", &obj) == FALSE) {
+        pthread_mutex_unlock(&json_lock);
+        reply = create_error_reply("Missing strict parameter.");
+        goto finalize;
+    }
+    strict = json_object_get_boolean(obj);
+    if (json_object_object_get_ex(request, "cache", &obj) == TRUE) {
+        use_cache = json_object_get_boolean(obj);
+    }
+    version = get_param_string(request, "version");
+    pthread_mutex_unlock(&json_lock);
+
+    if ((int)ds_type_s == -1) {
+        reply = create_error_reply("Invalid source repository type requested.");
+        goto finalize;
+    }
+
+    if (version) {
+        /* the previous tree is needed, fresh data always */
+        reply = getconfig_delta(session_key, ds_type_s, filter, strict, version);
+        CHECK_ERR_SET_REPLY_ERR("Get configuration operation failed.")
+        goto finalize;
+    }
+
+    if ((data = config_cache_get(session_key, ds_type_s, filter, strict, CONFIG_CACHE_TTL && use_cache, &gen))) {
+        DEBUG("Configuration served from the cache.");
+        reply = create_data_reply(data);
+        free(data);
+        goto finalize;
+    }
+
+    shared_data = netconf_read_shared(MSG_GETCONFIG, session_key, ds_type_s, filter, strict, gen, &shared, &joined,
+                                      &reply);
+    if (shared_data == NULL) {
+        CHECK_ERR_SET_REPLY_ERR("Get configuration operation failed.")
+    } else {
+        if (CONFIG_CACHE_TTL && !joined) {
+            /* the request that sent the RPC has already stored it */
+            config_cache_put(session_key, ds_type_s, filter, strict, gen, shared_data);
+        }
+        reply = read_request_reply(shared);
+        read_request_release(shared);
+    }
+
+finalize:
+    CHECK_AND_FREE(filter);
+    CHECK_AND_FREE(source);
+    CHECK_AND_FREE(version);
+    return reply;
+}
+
+json_object *
+handle_op_editconfig(json_object *request, unsigned int session_key, int idx, struct content_cache **conv_cache)
+{
+    NC_DATASTORE ds_type_t = -1;
+    NC_RPC_EDIT_DFLTOP defop_type = 0;
+    NC_RPC_EDIT_ERROPT erropt_type = 0;
+    NC_RPC_EDIT_TESTOPT testopt_type = 0;
+    char *defop = NULL;
+    char *erropt = NULL;
+    char *config = NULL;
+    char *target = NULL;
+    char *testopt = NULL;
+    char *urisource = NULL;
+    char *format = NULL;
+    char *validate = NULL;
+    int local_validation = 0;
+    json_object *reply = NULL, *configs, *obj;
+
+    DEBUG("Request: edit-config (session %u)", session_key);
+
+    pthread_mutex_lock(&json_lock);
+    /* get parameters */
+    if (json_object_object_get_ex(request, "configs", &configs) == FALSE) {
+        pthread_mutex_unlock(&json_lock);
+        reply = create_error_reply("Missing configs parameter.");
+        goto finalize;
+    }
+    obj = json_object_array_get_idx(configs, idx);
+    config = strdup(json_object_get_string(obj));
+
+    target = get_param_string(request, "target");
+    defop = get_param_string(request, "default-operation");
+    erropt = get_param_string(request, "error-option");
+    urisource = get_param_string(request, "uri-source");
+    testopt = get_param_string(request, "test-option");
+    format = get_param_string(request, "format");
+    validate = get_param_string(request, "validate");
+    if (json_object_object_get_ex(request, "local-validation", &obj) == TRUE) {
+        local_validation = json_object_get_boolean(obj);
+    }
+    pthread_mutex_unlock(&json_lock);
+
+    if (!target) {
+        reply = create_error_reply("Missing the target parameter.");
+        goto finalize;
+    }
+    ds_type_t = parse_datastore(target);
+
+    if (defop != NULL) {
+        if (strcmp(defop, "merge") == 0) {
+            defop_type = NC_RPC_EDIT_DFLTOP_MERGE;
+        } else if (strcmp(defop, "replace") == 0) {
+            defop_type = NC_RPC_EDIT_DFLTOP_REPLACE;
+        } else if (strcmp(defop, "none") == 0) {
+            defop_type = NC_RPC_EDIT_DFLTOP_NONE;
+        } else {
+            reply = create_error_reply("Invalid default-operation parameter.");
+            goto finalize;
+        }
+    } else {
+        defop_type = NC_RPC_EDIT_DFLTOP_UNKNOWN;
+    }
+
+    if (erropt != NULL) {
+        if (strcmp(erropt, "continue-on-error") == 0) {
+            erropt_type = NC_RPC_EDIT_ERROPT_CONTINUE;
+        } else if (strcmp(erropt, "stop-on-error") == 0) {
+            erropt_type = NC_RPC_EDIT_ERROPT_STOP;
+        } else if (strcmp(erropt, "rollback-on-error") == 0) {
+            erropt_type = NC_RPC_EDIT_ERROPT_ROLLBACK;
+        } else {
+            reply = create_error_reply("Invalid error-option parameter.");
+            goto finalize;
+        }
+    } else {
+        erropt_type = 0;
+    }
+
+    if ((config && urisource) || (!config && !urisource)) {
+        reply = create_error_reply("Invalid config and uri-source data parameters.");
+        goto finalize;
+    }
+
+    if (testopt != NULL) {
+        testopt_type = parse_testopt(testopt);
+    }
+
+    if (config) {
+        if (content_prepare(session_key, &config, format, validate, LYD_OPT_EDIT, "edit-config", conv_cache, &reply)) {
+            goto finalize;
+        }
+        if (local_validation
+                && (reply = edit_validate_locally(session_key, ds_type_t, defop_type, testopt_type, config))) {
+            /* do not even send it */
+            goto finalize;
+        }
+    } else {
+        config = urisource;
+        urisource = NULL;
+    }
+
+    reply = netconf_editconfig(session_key, ds_type_t, defop_type, erropt_type, testopt_type, config);
+    config_changed(session_key);
+    if ((ds_type_t == NC_DATASTORE_CANDIDATE) && reply && reply_is_ok(reply)) {
+        commit_batch_edit(session_key);
+    }
+
+    CHECK_ERR_SET_REPLY
+
+finalize:
+    CHECK_AND_FREE(defop);
+    CHECK_AND_FREE(erropt);
+    CHECK_AND_FREE(config);
+    CHECK_AND_FREE(urisource);
+    CHECK_AND_FREE(target);
+    CHECK_AND_FREE(testopt);
+    CHECK_AND_FREE(format);
+    CHECK_AND_FREE(validate);
+
+    return reply;
+}
+
+/**
+ * \brief Duplicate a data node without children, except for the keys of a list instance.
+ */
+static struct lyd_node *
+data_dup_instance(const struct lyd_node *node)
+{
+    struct lyd_node *dup, *child;
+    int i;
+
+    dup = lyd_dup(node, 0);
+    if (!dup || (node->schema->nodetype != LYS_LIST)) {
+        return dup;
+    }
+
+    /* the keys are needed to identify the instance, they are always the first children */
+    for (i = 0, child = node->child; child && (i < ((struct lys_node_list *)node->schema)->keys_size);
+            ++i, child = child->next) {
+        if (lyd_insert(dup, lyd_dup(child, 0))) {
+            lyd_free(dup);
+            return NULL;
+        }
+    }
+    return dup;
+}
+
+static const char *
+edit_node_operation(const struct lyd_node *node, const char *inherited)
+{
+    struct lyd_attr *attr;
+
+    for (attr = node->attr; attr; attr = attr->next) {
+        if (!strcmp(attr->name, "operation")) {
+            return attr->value_str;
+        }
+    }
+    return inherited;
+}
+
+/* find the data instance among siblings identified by the edit node */
+static struct lyd_node *
+data_instance_find(struct lyd_node *siblings, const struct lyd_node *node)
+{
+    struct lyd_node *iter, *key1, *key2;
+    int i;
+
+    LY_TREE_FOR(siblings, iter) {
+        if (iter->schema != node->schema) {
+            continue;
+        }
+        if (node->schema->nodetype == LYS_LEAFLIST) {
+            if (!strcmp(((struct lyd_node_leaf_list *)iter)->value_str, ((struct lyd_node_leaf_list *)node)->value_str)) {
+                return iter;
+            }
+        } else if (node->schema->nodetype == LYS_LIST) {
+            for (i = 0, key1 = iter->child, key2 = node->child;
+                 key1 && key2 && (i < ((struct lys_node_list *)node->schema)->keys_size);
+                 ++i, key1 = key1->next, key2 = key2->next) {
+                if (strcmp(((struct lyd_node_leaf_list *)key1)->value_str, ((struct lyd_node_leaf_list *)key2)->value_str)) {
+                    break;
+                }
+            }
+            if (i == ((struct lys_node_list *)node->schema)->keys_size) {
+                return iter;
+            }
+        } else {
+            return iter;
+        }
+    }
+    return NULL;
+}
+
+/* whether the node has any children except for list keys */
+static int
+data_has_content(const struct lyd_node *node)
+{
+    const struct lyd_node *child;
+    int keys;
+
+    keys = (node->schema->nodetype == LYS_LIST) ? ((struct lys_node_list *)node->schema)->keys_size : 0;
+    LY_TREE_FOR(node->child, child) {
+        if (keys) {
+            --keys;
+            continue;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int
+data_insert(struct lyd_node **tree, struct lyd_node *parent, struct lyd_node *node)
+{
+    if (!node) {
+        return -1;
+    }
+    if (parent) {
+        return lyd_insert(parent, node);
+    } else if (*tree) {
+        return lyd_insert_sibling(tree, node);
+    }
+    *tree = node;
+    return 0;
+}
+
+/* remove the NETCONF operation attributes from a data subtree copied from an edit */
+static void
+data_strip_operations(struct lyd_node *node)
+{
+    struct lyd_node *child;
+    struct lyd_attr *attr, *next;
+
+    for (attr = node->attr; attr; attr = next) {
+        next = attr->next;
+        if (!strcmp(attr->name, "operation")) {
+            lyd_free_attr(node->schema->module->ctx, node, attr, 0);
+        }
+    }
+    if (!(node->schema->nodetype & (LYS_LEAF | LYS_LEAFLIST | LYS_ANYDATA))) {
+        LY_TREE_FOR(node->child, child) {
+            data_strip_operations(child);
+        }
+    }
+}
+
+/* whether the node is a key of its parent list instance */
+static int
+data_is_list_key(const struct lyd_node *node)
+{
+    const struct lys_node_list *list;
+    int i;
+
+    if (!node->parent || (node->parent->schema->nodetype != LYS_LIST)) {
+        return 0;
+    }
+    list = (const struct lys_node_list *)node->parent->schema;
+    for (i = 0; i < list->keys_size; ++i) {
+        if ((const struct lys_node *)list->keys[i] == node->schema) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Apply NETCONF edit-config content on a data tree.
+ *
+ * Follows RFC 6241 7.2, operation "none" on a node missing in the data is the data-missing error.
+ *
+ * \param[in,out] tree First top-level sibling of the data tree.
+ * \param[in] parent Data node the edit nodes are children of, NULL for top-level nodes.
+ * \param[in] edit First edit node.
+ * \param[in] dflt_op Operation inherited from the parent (or default-operation).
+ * \param[out] errmsg Error message on error.
+ * \return 0 on success, -1 on error.
+ */
+static int
+edit_apply(struct lyd_node **tree, struct lyd_node *parent, struct lyd_node *edit, const char *dflt_op, char **errmsg)
+{
+    struct lyd_node *enode, *match, *dup;
+    const char *op;
+    char *path;
+
+    LY_TREE_FOR(edit, enode) {
+        if (data_is_list_key(enode)) {
+            /* identifies the instance, it was created with it */
+            continue;
+        }
+        op = edit_node_operation(enode, dflt_op);
+        match = data_instance_find(parent ? parent->child : *tree, enode);
+
+        if (match && !strcmp(op, "create")) {
+            path = lyd_path(enode);
+            asprintf(errmsg, "Data already exist (%s).", path);
+            free(path);
+            return -1;
+        } else if (!match && (!strcmp(op, "delete") || !strcmp(op, "none"))) {
+            path = lyd_path(enode);
+            asprintf(errmsg, "Data are missing (%s).", path);
+            free(path);
+            return -1;
+        }
+
+        if (match && (!strcmp(op, "delete") || !strcmp(op, "remove") || !strcmp(op, "replace"))) {
+            if (match == *tree) {
+                *tree = match->next;
+            }
+            lyd_free(match);
+            match = NULL;
+        }
+        if (!strcmp(op, "delete") || !strcmp(op, "remove")) {
+            continue;
+        }
+
+        if (enode->schema->nodetype & (LYS_LEAF | LYS_LEAFLIST | LYS_ANYDATA)) {
+            if (!strcmp(op, "none") || (match && (enode->schema->nodetype == LYS_LEAFLIST))) {
+                continue;
+            }
+            if (match && (enode->schema->nodetype == LYS_LEAF)) {
+                if (lyd_change_leaf((struct lyd_node_leaf_list *)match, ((struct lyd_node_leaf_list *)enode)->value_str) < 0) {
+                    goto insert_error;
+                }
+                continue;
+            }
+            if (match) {
+                if (match == *tree) {
+                    *tree = match->next;
+                }
+                lyd_free(match);
+            }
+            dup = lyd_dup(enode, 1);
+            if (data_insert(tree, parent, dup)) {
+                lyd_free(dup);
+                goto insert_error;
+            }
+            data_strip_operations(dup);
+            continue;
+        }
+
+        /* create, replace, merge or none of an inner node, its children inherit the operation */
+        if (!match) {
+            match = data_dup_instance(enode);
+            if (data_insert(tree, parent, match)) {
+                lyd_free(match);
+                goto insert_error;
+            }
+            data_strip_operations(match);
+        }
+        if (edit_apply(tree, match, enode->child, op, errmsg)) {
+            return -1;
         }
-    } else {
-        /* positive reply */
-        reply = json_object_new_object();
-        json_object_object_add(reply, "type", json_object_new_int(REPLY_OK));
-        json_object_object_add(reply, "session", json_object_new_int(session_key));
     }
-    memset(pass, 0, strlen(pass));
-    pthread_mutex_unlock(&json_lock);
-    CHECK_AND_FREE(host);
-    CHECK_AND_FREE(user);
-    CHECK_AND_FREE(port);
-    CHECK_AND_FREE(pass);
-    CHECK_AND_FREE(privkey);
-    return reply;
+    return 0;
+
+insert_error:
+    path = lyd_path(enode);
+    asprintf(errmsg, "Failed to apply the edit (%s).", path);
+    free(path);
+    return -1;
 }
 
-json_object *
-handle_op_disconnect(json_object *UNUSED(request), unsigned int session_key)
+/**
+ * \brief Apply edit-config content on a copy of the target datastore and validate the result.
+ *
+ * \param[in] session_key Session.
+ * \param[in] target Target datastore.
+ * \param[in] defop Default operation.
+ * \param[in] testopt Test option, with "set" the result is not validated (only applied).
+ * \param[in] config XML edit-config content.
+ * \return NULL if the edit is valid or the target cannot be validated locally (url),
+ * json object with error otherwise
+ */
+static json_object *
+edit_validate_locally(unsigned int session_key, NC_DATASTORE target, NC_RPC_EDIT_DFLTOP defop,
+                      NC_RPC_EDIT_TESTOPT testopt, const char *config)
 {
-    json_object *reply = NULL;
+    struct session_with_mutex *locked_session;
+    struct lyd_node *data = NULL, *edit;
+    struct ly_ctx *ctx;
+    json_object *reply;
+    char *errmsg = NULL;
+    const char *dflt_op;
 
-    DEBUG("Request: disconnect (session %u)", session_key);
+    switch (target) {
+    case NC_DATASTORE_RUNNING:
+    case NC_DATASTORE_STARTUP:
+    case NC_DATASTORE_CANDIDATE:
+        break;
+    default:
+        /* no local copy of a url target, leave the validation to the server */
+        DEBUG("Local validation skipped, not supported for the edit-config target.");
+        return NULL;
+    }
 
-    if (netconf_close(session_key, &reply) != EXIT_SUCCESS) {
-        CHECK_ERR_SET_REPLY_ERR("Get configuration information from device failed.")
-    } else {
-        reply = create_ok_reply();
+    if ((reply = config_tree_get(session_key, target, 1, &data))) {
+        return reply;
+    }
+
+    switch (defop) {
+    case NC_RPC_EDIT_DFLTOP_REPLACE:
+        dflt_op = "replace";
+        break;
+    case NC_RPC_EDIT_DFLTOP_NONE:
+        dflt_op = "none";
+        break;
+    default:
+        dflt_op = "merge";
+        break;
+    }
+
+    locked_session = session_get_locked(session_key, &reply);
+    if (!locked_session) {
+        lyd_free_withsiblings(data);
+        return reply;
     }
+    ctx = nc_session_get_ctx(locked_session->session);
 
+    edit = lyd_parse_mem(ctx, config, LYD_XML, LYD_OPT_EDIT);
+    if (!edit && config[0]) {
+        asprintf(&errmsg, "Local validation failed: %s (%s).", ly_errmsg(), ly_errpath());
+    } else if (edit_apply(&data, NULL, edit, dflt_op, &errmsg)) {
+        /* errmsg set */
+    } else if ((testopt != NC_RPC_EDIT_TESTOPT_SET) && lyd_validate(&data, LYD_OPT_CONFIG, ctx)) {
+        asprintf(&errmsg, "Local validation failed: %s (%s).", ly_errmsg(), ly_errpath());
+    }
+    lyd_free_withsiblings(edit);
+    lyd_free_withsiblings(data);
+    session_unlock(locked_session);
+
+    if (errmsg) {
+        reply = create_error_reply(errmsg);
+        free(errmsg);
+    }
     return reply;
 }
 
-json_object *
-handle_op_get(json_object *request, unsigned int session_key)
+/**
+ * \brief Add a data node with all its parents into an edit tree.
+ *
+ * \param[in,out] edit Edit tree.
+ * \param[in] node Node to add, with its subtree if \p subtree is set.
+ * \param[in] subtree Whether to add the whole subtree of \p node.
+ * \param[in] operation NETCONF operation of the node.
+ * \return 0 on success, -1 on error.
+ */
+static int
+edit_tree_add(struct lyd_node **edit, struct lyd_node *node, int subtree, const char *operation)
 {
-    char *filter = NULL;
-    char *data = NULL;
-    json_object *reply = NULL, *obj;
-    int strict;
-
-    DEBUG("Request: get (session %u)", session_key);
+    struct lyd_node *parent = NULL, *dup, *created;
+    struct ly_set *set;
+    struct ly_ctx *ctx = node->schema->module->ctx;
+    const struct lys_module *ietf_nc;
+    char *path;
+    int ret = 0;
+
+    ietf_nc = ly_ctx_get_module(ctx, "ietf-netconf", NULL);
+    if (!ietf_nc) {
+        return -1;
+    }
+
+    if (node->parent) {
+        /* create the parents (with list keys) */
+        path = lyd_path(node->parent);
+        if (!path) {
+            return -1;
+        }
+        /* the parents may already exist for a previous sibling, creating them again is an error */
+        set = *edit ? lyd_find_path(*edit, path) : NULL;
+        if (!set || !set->number) {
+            ly_set_free(set);
+            if (!*edit) {
+                *edit = lyd_new_path(NULL, ctx, path, NULL, 0, 0);
+                created = *edit;
+            } else {
+                created = lyd_new_path(*edit, ctx, path, NULL, 0, 0);
+            }
+            set = created ? lyd_find_path(*edit, path) : NULL;
+        }
+        free(path);
+        if (!set || (set->number != 1)) {
+            ly_set_free(set);
+            return -1;
+        }
+        parent = set->set.d[0];
+        ly_set_free(set);
+    }
 
-    pthread_mutex_lock(&json_lock);
-    filter = get_param_string(request, "filter");
-    if (json_object_object_get_ex(request, "strict", &obj) == FALSE) {
-        pthread_mutex_unlock(&json_lock);
-        reply = create_error_reply("Missing strict parameter.");
-        goto finalize;
+    dup = subtree ? lyd_dup(node, 1) : data_dup_instance(node);
+    if (!dup) {
+        return -1;
     }
-    strict = json_object_get_boolean(obj);
-    pthread_mutex_unlock(&json_lock);
 
-    if ((data = netconf_get(session_key, filter, strict, &reply)) == NULL) {
-        CHECK_ERR_SET_REPLY_ERR("Get information failed.")
+    if (parent) {
+        ret = lyd_insert(parent, dup);
+    } else if (!*edit) {
+        *edit = dup;
     } else {
-        reply = create_data_reply(data);
-        free(data);
+        ret = lyd_insert_sibling(edit, dup);
+    }
+    if (ret) {
+        lyd_free(dup);
+        return -1;
     }
 
-finalize:
-    CHECK_AND_FREE(filter);
-    return reply;
+    if (!lyd_insert_attr(dup, ietf_nc, "operation", operation)) {
+        return -1;
+    }
+    return 0;
 }
 
-json_object *
-handle_op_getconfig(json_object *request, unsigned int session_key)
+/**
+ * \brief Create minimal edit-config content transforming \p current into \p desired.
+ *
+ * \param[in] current Current configuration.
+ * \param[in] desired Desired configuration.
+ * \param[out] edit Edit tree, NULL if there are no changes.
+ * \return 0 on success, 1 if the change cannot be expressed, -1 on error.
+ */
+static int
+desired_config_edit(struct lyd_node *current, struct lyd_node *desired, struct lyd_node **edit)
 {
-    NC_DATASTORE ds_type_s = -1;
-    char *filter = NULL;
-    char *data = NULL;
-    char *source = NULL;
-    json_object *reply = NULL, *obj;
-    int strict;
-
-    DEBUG("Request: get-config (session %u)", session_key);
+    struct lyd_difflist *diff;
+    int i, ret = 0;
 
-    pthread_mutex_lock(&json_lock);
-    filter = get_param_string(request, "filter");
-    source = get_param_string(request, "source");
-    if (source != NULL) {
-        ds_type_s = parse_datastore(source);
-    }
-    if (json_object_object_get_ex(request, "strict", &obj) == FALSE) {
-        pthread_mutex_unlock(&json_lock);
-        reply = create_error_reply("Missing strict parameter.");
-        goto finalize;
+    *edit = NULL;
+    if (!current && !desired) {
+        return 0;
     }
-    strict = json_object_get_boolean(obj);
-    pthread_mutex_unlock(&json_lock);
 
-    if ((int)ds_type_s == -1) {
-        reply = create_error_reply("Invalid source repository type requested.");
-        goto finalize;
+    diff = lyd_diff(current, desired, 0);
+    if (!diff) {
+        return -1;
     }
 
-    if ((data = netconf_getconfig(session_key, ds_type_s, filter, strict, &reply)) == NULL) {
-        CHECK_ERR_SET_REPLY_ERR("Get configuration operation failed.")
-    } else {
-        reply = create_data_reply(data);
-        free(data);
+    for (i = 0; !ret && (diff->type[i] != LYD_DIFF_END); ++i) {
+        switch (diff->type[i]) {
+        case LYD_DIFF_DELETED:
+            ret = edit_tree_add(edit, diff->first[i], 0, "delete");
+            break;
+        case LYD_DIFF_CHANGED:
+            ret = edit_tree_add(edit, diff->second[i], 1, "merge");
+            break;
+        case LYD_DIFF_CREATED:
+            ret = edit_tree_add(edit, diff->second[i], 1, "create");
+            break;
+        default:
+            /* moved user-ordered items */
+            ret = 1;
+            break;
+        }
     }
+    lyd_free_diff(diff);
 
-finalize:
-    CHECK_AND_FREE(filter);
-    CHECK_AND_FREE(source);
-    return reply;
+    if (ret) {
+        lyd_free_withsiblings(*edit);
+        *edit = NULL;
+    }
+    return ret;
 }
 
 json_object *
-handle_op_editconfig(json_object *request, unsigned int session_key, int idx)
+handle_op_desiredconfig(json_object *request, unsigned int session_key, int idx)
 {
     NC_DATASTORE ds_type_t = -1;
-    NC_RPC_EDIT_DFLTOP defop_type = 0;
-    NC_RPC_EDIT_ERROPT erropt_type = 0;
-    NC_RPC_EDIT_TESTOPT testopt_type = 0;
-    char *defop = NULL;
-    char *erropt = NULL;
-    char *config = NULL;
-    char *target = NULL;
-    char *testopt = NULL;
-    char *urisource = NULL;
-    json_object *reply = NULL, *configs, *obj;
-    struct lyd_node *content;
+    char *config = NULL, *target = NULL, *format = NULL, *edit_xml = NULL;
     struct session_with_mutex *locked_session;
+    struct lyd_node *desired = NULL, *current = NULL, *edit = NULL;
+    json_object *reply = NULL, *configs, *obj;
+    int use_cache = 1, ret;
 
-    DEBUG("Request: edit-config (session %u)", session_key);
+    DEBUG("Request: desired-config (session %u)", session_key);
 
     pthread_mutex_lock(&json_lock);
-    /* get parameters */
     if (json_object_object_get_ex(request, "configs", &configs) == FALSE) {
         pthread_mutex_unlock(&json_lock);
         reply = create_error_reply("Missing configs parameter.");
         goto finalize;
     }
     obj = json_object_array_get_idx(configs, idx);
+    if (!obj) {
+        pthread_mutex_unlock(&json_lock);
+        reply = create_error_reply("Configs array parameter shorter than sessions.");
+        goto finalize;
+    }
     config = strdup(json_object_get_string(obj));
-
     target = get_param_string(request, "target");
-    defop = get_param_string(request, "default-operation");
-    erropt = get_param_string(request, "error-option");
-    urisource = get_param_string(request, "uri-source");
-    testopt = get_param_string(request, "test-option");
+    format = get_param_string(request, "format");
+    if (json_object_object_get_ex(request, "cache", &obj) == TRUE) {
+        use_cache = json_object_get_boolean(obj);
+    }
     pthread_mutex_unlock(&json_lock);
 
-    if (!target) {
-        reply = create_error_reply("Missing the target parameter.");
+    if (!target || (((ds_type_t = parse_datastore(target)) != NC_DATASTORE_RUNNING)
+            && (ds_type_t != NC_DATASTORE_CANDIDATE) && (ds_type_t != NC_DATASTORE_STARTUP))) {
+        reply = create_error_reply("Invalid target repository type requested.");
         goto finalize;
     }
-    ds_type_t = parse_datastore(target);
-
-    if (defop != NULL) {
-        if (strcmp(defop, "merge") == 0) {
-            defop_type = NC_RPC_EDIT_DFLTOP_MERGE;
-        } else if (strcmp(defop, "replace") == 0) {
-            defop_type = NC_RPC_EDIT_DFLTOP_REPLACE;
-        } else if (strcmp(defop, "none") == 0) {
-            defop_type = NC_RPC_EDIT_DFLTOP_NONE;
-        } else {
-            reply = create_error_reply("Invalid default-operation parameter.");
-            goto finalize;
-        }
-    } else {
-        defop_type = NC_RPC_EDIT_DFLTOP_UNKNOWN;
+    if (format && strcmp(format, "json") && strcmp(format, "xml")) {
+        reply = create_error_reply("Invalid format parameter.");
+        goto finalize;
     }
 
-    if (erropt != NULL) {
-        if (strcmp(erropt, "continue-on-error") == 0) {
-            erropt_type = NC_RPC_EDIT_ERROPT_CONTINUE;
-        } else if (strcmp(erropt, "stop-on-error") == 0) {
-            erropt_type = NC_RPC_EDIT_ERROPT_STOP;
-        } else if (strcmp(erropt, "rollback-on-error") == 0) {
-            erropt_type = NC_RPC_EDIT_ERROPT_ROLLBACK;
-        } else {
-            reply = create_error_reply("Invalid error-option parameter.");
-            goto finalize;
-        }
-    } else {
-        erropt_type = 0;
+    locked_session = session_get_locked(session_key, &reply);
+    if (!locked_session) {
+        goto finalize;
     }
-
-    if ((config && urisource) || (!config && !urisource)) {
-        reply = create_error_reply("Invalid config and uri-source data parameters.");
+    desired = lyd_parse_mem(nc_session_get_ctx(locked_session->session), config,
+                            (format && !strcmp(format, "xml")) ? LYD_XML : LYD_JSON, LYD_OPT_CONFIG);
+    session_unlock(locked_session);
+    if (!desired && config[0] && strcmp(config, "{}")) {
+        reply = create_error_reply("Failed to parse desired configuration.");
         goto finalize;
     }
 
-    if (config) {
-        locked_session = session_get_locked(session_key, NULL);
-        if (!locked_session) {
-            reply = create_error_reply("Unknown session or locking failed.");
-            goto finalize;
-        }
-
-        content = lyd_parse_mem(nc_session_get_ctx(locked_session->session), config, LYD_JSON, LYD_OPT_EDIT);
-        session_unlock(locked_session);
-
-        if (!content) {
-        	reply = create_error_reply("Failed to parse edit-config content.");
-            goto finalize;
-        }
-
-        free(config);
-        config = NULL;
+    if ((reply = config_tree_get(session_key, ds_type_t, use_cache, &current))) {
+        goto finalize;
+    }
 
-        lyd_print_mem(&config, content, LYD_XML, LYP_WITHSIBLINGS);
-        lyd_free_withsiblings(content);
-        if (!config) {
-        	reply = create_error_reply("Failed to print edit-config content.");
-            goto finalize;
-        }
-    } else {
-        config = urisource;
+    ret = desired_config_edit(current, desired, &edit);
+    if (ret == 1) {
+        /* not expressible as a minimal edit, replace everything */
+        DEBUG("Replacing the whole configuration.");
+        edit = desired;
+        desired = NULL;
+    } else if (ret) {
+        reply = create_error_reply("Failed to create the configuration changes.");
+        goto finalize;
+    } else if (!edit) {
+        DEBUG("Configuration is already in the desired state.");
+        reply = create_ok_reply();
+        goto finalize;
     }
 
-    if (testopt != NULL) {
-        testopt_type = parse_testopt(testopt);
+    if (lyd_print_mem(&edit_xml, edit, LYD_XML, LYP_WITHSIBLINGS) || !edit_xml) {
+        reply = create_error_reply("Failed to print edit-config content.");
+        goto finalize;
     }
 
-    reply = netconf_editconfig(session_key, ds_type_t, defop_type, erropt_type, testopt_type, config);
+    reply = netconf_editconfig(session_key, ds_type_t, (ret == 1) ? NC_RPC_EDIT_DFLTOP_REPLACE : NC_RPC_EDIT_DFLTOP_NONE,
+                               0, 0, edit_xml);
+    config_changed(session_key);
 
     CHECK_ERR_SET_REPLY
+    if (!reply) {
+        reply = create_ok_reply();
+    }
 
 finalize:
-    CHECK_AND_FREE(defop);
-    CHECK_AND_FREE(erropt);
+    lyd_free_withsiblings(desired);
+    lyd_free_withsiblings(current);
+    lyd_free_withsiblings(edit);
     CHECK_AND_FREE(config);
-    CHECK_AND_FREE(urisource);
     CHECK_AND_FREE(target);
-    CHECK_AND_FREE(testopt);
-
+    CHECK_AND_FREE(format);
+    CHECK_AND_FREE(edit_xml);
     return reply;
 }
 
 json_object *
-handle_op_copyconfig(json_object *request, unsigned int session_key, int idx)
+handle_op_copyconfig(json_object *request, unsigned int session_key, int idx, struct content_cache **conv_cache)
 {
     NC_DATASTORE ds_type_s = -1;
     NC_DATASTORE ds_type_t = -1;
@@ -2640,9 +6378,9 @@ handle_op_copyconfig(json_object *request, unsigned int session_key, int idx)
     char *source = NULL;
     char *uri_src = NULL;
     char *uri_trg = NULL;
+    char *format = NULL;
+    char *validate = NULL;
     json_object *reply = NULL, *configs, *obj;
-    struct lyd_node *content;
-    struct session_with_mutex *locked_session;
 
     DEBUG("Request: copy-config (session %u)", session_key);
 
@@ -2652,6 +6390,8 @@ handle_op_copyconfig(json_object *request, unsigned int session_key, int idx)
     source = get_param_string(request, "source");
     uri_src = get_param_string(request, "uri-source");
     uri_trg = get_param_string(request, "uri-target");
+    format = get_param_string(request, "format");
+    validate = get_param_string(request, "validate");
     if (!strcmp(source, "config")) {
         if (json_object_object_get_ex(request, "configs", &configs) == FALSE) {
             pthread_mutex_unlock(&json_lock);
@@ -2699,21 +6439,13 @@ handle_op_copyconfig(json_object *request, unsigned int session_key, int idx)
     }
 
     if (config) {
-        locked_session = session_get_locked(session_key, NULL);
-        if (!locked_session) {
-        	reply = create_error_reply("Unknown session or locking failed.");
+        if (content_prepare(session_key, &config, format, validate, LYD_OPT_CONFIG, "copy-config", conv_cache, &reply)) {
             goto finalize;
         }
-
-        content = lyd_parse_mem(nc_session_get_ctx(locked_session->session), config, LYD_JSON, LYD_OPT_CONFIG);
-        session_unlock(locked_session);
-
-        free(config);
-        lyd_print_mem(&config, content, LYD_XML, LYP_WITHSIBLINGS);
-        lyd_free_withsiblings(content);
     }
 
     reply = netconf_copyconfig(session_key, ds_type_s, ds_type_t, config, uri_src, uri_trg);
+    config_changed(session_key);
 
     CHECK_ERR_SET_REPLY
 
@@ -2723,6 +6455,8 @@ finalize:
     CHECK_AND_FREE(source);
     CHECK_AND_FREE(uri_src);
     CHECK_AND_FREE(uri_trg);
+    CHECK_AND_FREE(format);
+    CHECK_AND_FREE(validate);
 
     return reply;
 }
@@ -2755,6 +6489,7 @@ handle_op_deleteconfig(json_object *request, unsigned int session_key)
     }
 
     reply = netconf_deleteconfig(session_key, ds_type, url);
+    config_changed(session_key);
 
     CHECK_ERR_SET_REPLY
     if (reply == NULL) {
@@ -2883,7 +6618,12 @@ handle_op_info(json_object *UNUSED(request), unsigned int session_key)
             ERROR("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
         }
         if (locked_session->hello_message != NULL) {
+            pthread_mutex_lock(&json_lock);
+            json_object_object_add(locked_session->hello_message, "notifications-dropped",
+                                   json_object_new_int64(__atomic_load_n(&locked_session->notif_ring.dropped,
+                                                                         __ATOMIC_RELAXED)));
             reply = json_object_get(locked_session->hello_message);
+            pthread_mutex_unlock(&json_lock);
         } else {
             reply = create_error_reply("Invalid session identifier.");
         }
@@ -2901,12 +6641,11 @@ handle_op_info(json_object *UNUSED(request), unsigned int session_key)
 }
 
 json_object *
-handle_op_generic(json_object *request, unsigned int session_key, int idx)
+handle_op_generic(json_object *request, unsigned int session_key, int idx, struct content_cache **conv_cache)
 {
     json_object *reply = NULL, *contents, *obj;
-    char *content = NULL, *str;
-    struct lyd_node *data = NULL, *node_content;
-    struct session_with_mutex *locked_session;
+    char *content = NULL, *str, *format = NULL, *validate = NULL;
+    struct lyd_node *data = NULL;
 
     DEBUG("Request: generic request (session %u)", session_key);
 
@@ -2923,22 +6662,17 @@ handle_op_generic(json_object *request, unsigned int session_key, int idx)
         goto finalize;
     }
     content = strdup(json_object_get_string(obj));
+    format = get_param_string(request, "format");
+    validate = get_param_string(request, "validate");
     pthread_mutex_unlock(&json_lock);
 
-    locked_session = session_get_locked(session_key, NULL);
-    if (!locked_session) {
-    	reply = create_error_reply("Unknown session or locking failed.");
+    if (content_prepare(session_key, &content, format, validate, LYD_OPT_RPC, "generic RPC", conv_cache, &reply)) {
         goto finalize;
     }
 
-    node_content = lyd_parse_mem(nc_session_get_ctx(locked_session->session), content, LYD_JSON, LYD_OPT_RPC, NULL);
-    session_unlock(locked_session);
-
-    free(content);
-    lyd_print_mem(&content, node_content, LYD_XML, LYP_WITHSIBLINGS);
-    lyd_free_withsiblings(node_content);
-
     reply = netconf_generic(session_key, content, &data);
+    /* the operation is unknown, it could have changed the configuration */
+    config_changed(session_key);
     if (reply == NULL) {
         GETSPEC_ERR_REPLY
         if (err_reply != NULL) {
@@ -2961,6 +6695,8 @@ handle_op_generic(json_object *request, unsigned int session_key, int idx)
 
 finalize:
     CHECK_AND_FREE(content);
+    CHECK_AND_FREE(format);
+    CHECK_AND_FREE(validate);
     return reply;
 }
 
@@ -3245,25 +6981,291 @@ finalize:
     return reply;
 }
 
-json_object *
-handle_op_commit(unsigned int session_key)
+/**
+ * \brief Write-behind commits of a session, concurrent commit requests are coalesced into a single <commit>
+ */
+struct commit_batch {
+    unsigned int session_key;
+    unsigned int window;    /**< minimal time between two commits in milliseconds */
+    unsigned int max_edits; /**< number of edits committed without waiting for the window, 0 for no limit */
+
+    unsigned int edits;     /**< edits of the candidate since the last commit */
+    unsigned int gen;       /**< batch collecting the commit requests */
+    unsigned int done_gen;  /**< last committed batch */
+    char leader;            /**< a request commits the current batch */
+    char closed;            /**< the session was closed */
+    char *result;           /**< serialized reply of the last committed batch */
+    struct timespec last;   /**< time of the last commit (CLOCK_REALTIME) */
+    unsigned int refs;
+    struct commit_batch *next;
+};
+
+static struct commit_batch *commit_batches;
+
+static struct commit_batch *
+commit_batch_find(unsigned int session_key)
+{
+    struct commit_batch *b;
+
+    for (b = commit_batches; b && (b->session_key != session_key); b = b->next);
+    return b;
+}
+
+/* commit_batches_lock must be held */
+static void
+commit_batch_release(struct commit_batch *b)
+{
+    if (!--b->refs) {
+        free(b->result);
+        free(b);
+    }
+}
+
+/**
+ * \brief Enable write-behind commits of a session.
+ *
+ * \param[in] session_key Session.
+ * \param[in] window Minimal time between two commits in milliseconds.
+ * \param[in] max_edits Number of edits committed without waiting for the window, 0 for no limit.
+ */
+static void
+commit_batch_create(unsigned int session_key, unsigned int window, unsigned int max_edits)
+{
+    struct commit_batch *b;
+
+    b = calloc(1, sizeof *b);
+    if (!b) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return;
+    }
+    b->session_key = session_key;
+    b->window = window;
+    b->max_edits = max_edits;
+    b->gen = 1;
+    b->refs = 1;
+
+    pthread_mutex_lock(&commit_batches_lock);
+    b->next = commit_batches;
+    commit_batches = b;
+    pthread_mutex_unlock(&commit_batches_lock);
+}
+
+/**
+ * \brief Disable write-behind commits of a closed session, the waiting batch is committed (and fails) at once.
+ */
+static void
+commit_batch_remove(unsigned int session_key)
+{
+    struct commit_batch *b, *prev = NULL;
+
+    pthread_mutex_lock(&commit_batches_lock);
+    for (b = commit_batches; b && (b->session_key != session_key); prev = b, b = b->next);
+    if (b) {
+        if (prev) {
+            prev->next = b->next;
+        } else {
+            commit_batches = b->next;
+        }
+        b->closed = 1;
+        pthread_cond_broadcast(&commit_batches_cond);
+        commit_batch_release(b);
+    }
+    pthread_mutex_unlock(&commit_batches_lock);
+}
+
+/**
+ * \brief Count an edit of the candidate of a session with write-behind commits.
+ */
+static void
+commit_batch_edit(unsigned int session_key)
+{
+    struct commit_batch *b;
+
+    pthread_mutex_lock(&commit_batches_lock);
+    b = commit_batch_find(session_key);
+    if (b) {
+        ++b->edits;
+        if (b->max_edits && (b->edits >= b->max_edits)) {
+            pthread_cond_broadcast(&commit_batches_cond);
+        }
+    }
+    pthread_mutex_unlock(&commit_batches_lock);
+}
+
+/**
+ * \brief Commit the candidate of a session with write-behind commits.
+ *
+ * The first waiting request commits the batch once the window since the last commit elapses
+ * or enough edits are made, all the requests of the batch receive the same reply.
+ *
+ * \param[in] session_key Session.
+ * \param[out] batched Set if the session uses write-behind commits.
+ * \return Reply of the batch commit.
+ */
+static json_object *
+commit_batched(unsigned int session_key, int *batched)
 {
+    struct commit_batch *b;
+    struct request_ctx *ctx;
+    struct nc_rpc *rpc;
+    struct timespec deadline, limit;
     json_object *reply = NULL;
-    char *target = NULL;
-    char *url = NULL;
+    enum json_tokener_error tok_err;
+    unsigned int gen;
+    char *result;
+
+    pthread_mutex_lock(&commit_batches_lock);
+    b = commit_batch_find(session_key);
+    if (!b) {
+        pthread_mutex_unlock(&commit_batches_lock);
+        *batched = 0;
+        return NULL;
+    }
+    *batched = 1;
+    ++b->refs;
+    gen = b->gen;
+
+    request_deadline(RPC_TIMEOUT_WRITE, &limit);
+    while (b->done_gen < gen) {
+        if (b->leader) {
+            if (request_cond_wait(&commit_batches_cond, &commit_batches_lock, &limit)) {
+                /* the batch is committed anyway, only its result is not waited for */
+                reply = request_abandoned_reply();
+                break;
+            }
+            continue;
+        }
+
+        /* lead the batch, the window wait is bounded by the request as well */
+        b->leader = 1;
+        deadline = b->last;
+        deadline.tv_sec += b->window / 1000;
+        deadline.tv_nsec += (b->window % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if ((limit.tv_sec < deadline.tv_sec) || ((limit.tv_sec == deadline.tv_sec) && (limit.tv_nsec < deadline.tv_nsec))) {
+            deadline = limit;
+        }
+        while (!b->closed && (!b->max_edits || (b->edits < b->max_edits))
+                && !request_cond_wait(&commit_batches_cond, &commit_batches_lock, &deadline));
+        if (!request_wait_time(&limit, 0)) {
+            /* cancelled or timed out before committing, another request of the batch takes over */
+            b->leader = 0;
+            pthread_cond_broadcast(&commit_batches_cond);
+            reply = request_abandoned_reply();
+            break;
+        }
+
+        /* following requests form the next batch */
+        ++b->gen;
+        b->edits = 0;
+        pthread_mutex_unlock(&commit_batches_lock);
+
+        /* the commit belongs to the whole batch, it is not abandoned with the leader */
+        ctx = pthread_getspecific(request_ctx_key);
+        pthread_setspecific(request_ctx_key, NULL);
+        DEBUG("Committing a batch (session %u).", session_key);
+        rpc = nc_rpc_commit(0, 0, NULL, NULL, NC_PARAMTYPE_CONST);
+        if (!rpc) {
+            reply = create_error_reply("Creation of RPC request failed.");
+        } else {
+            reply = netconf_op(session_key, rpc, 0, NULL);
+            nc_rpc_free(rpc);
+            CHECK_ERR_SET_REPLY
+            if (!reply) {
+                reply = create_ok_reply();
+            }
+        }
+        pthread_setspecific(request_ctx_key, ctx);
+        config_changed(session_key);
+        pthread_mutex_lock(&json_lock);
+        result = strdup(json_object_to_json_string(reply));
+        pthread_mutex_unlock(&json_lock);
+
+        pthread_mutex_lock(&commit_batches_lock);
+        clock_gettime(CLOCK_REALTIME, &b->last);
+        free(b->result);
+        b->result = result;
+        b->done_gen = gen;
+        b->leader = 0;
+        pthread_cond_broadcast(&commit_batches_cond);
+
+        if (!request_wait_time(&limit, 0)) {
+            /* only the leader gave up meanwhile, the others get the result */
+            pthread_mutex_lock(&json_lock);
+            json_object_put(reply);
+            pthread_mutex_unlock(&json_lock);
+            reply = request_abandoned_reply();
+        }
+    }
+
+    if (!reply) {
+        /* committed by another request */
+        pthread_mutex_lock(&json_lock);
+        reply = b->result ? json_tokener_parse_verbose(b->result, &tok_err) : NULL;
+        pthread_mutex_unlock(&json_lock);
+        if (!reply) {
+            reply = create_error_reply("Commit failed.");
+        }
+    }
+    commit_batch_release(b);
+    pthread_mutex_unlock(&commit_batches_lock);
+
+    return reply;
+}
+
+json_object *
+handle_op_commit(json_object *request, unsigned int session_key)
+{
+    json_object *reply = NULL, *obj;
+    char *persist = NULL;
+    char *persist_id = NULL;
+    int confirmed = 0, cancel = 0, batched;
+    uint32_t timeout = 0;
     struct nc_rpc *rpc = NULL;
 
     DEBUG("Request: commit (session %u)", session_key);
 
-    /* commit */
-    rpc = nc_rpc_commit(0, 0, NULL, NULL, NC_PARAMTYPE_CONST);
+    pthread_mutex_lock(&json_lock);
+    if (json_object_object_get_ex(request, "confirmed", &obj) == TRUE) {
+        confirmed = json_object_get_boolean(obj);
+    }
+    if (json_object_object_get_ex(request, "confirm-timeout", &obj) == TRUE) {
+        timeout = json_object_get_int(obj);
+    }
+    if (json_object_object_get_ex(request, "cancel", &obj) == TRUE) {
+        cancel = json_object_get_boolean(obj);
+    }
+    persist = get_param_string(request, "persist");
+    persist_id = get_param_string(request, "persist-id");
+    pthread_mutex_unlock(&json_lock);
+
+    if (!confirmed && !cancel && !persist_id) {
+        /* plain commits of write-behind sessions are coalesced */
+        reply = commit_batched(session_key, &batched);
+        if (batched) {
+            goto finalize;
+        }
+    }
+
+    if (cancel) {
+        /* cancel-commit */
+        rpc = nc_rpc_cancel(persist_id, NC_PARAMTYPE_CONST);
+    } else {
+        /* commit */
+        rpc = nc_rpc_commit(confirmed, timeout, persist, persist_id, NC_PARAMTYPE_CONST);
+    }
     if (rpc == NULL) {
         DEBUG("mod_netconf: creating rpc request failed");
         reply = create_error_reply("Creation of RPC request failed.");
         goto finalize;
     }
 
-    if ((reply = netconf_op(session_key, rpc, 0, NULL)) == NULL) {
+    reply = netconf_op(session_key, rpc, 0, NULL);
+    config_changed(session_key);
+    if (reply == NULL) {
         CHECK_ERR_SET_REPLY
 
         if (reply == NULL) {
@@ -3274,11 +7276,191 @@ handle_op_commit(unsigned int session_key)
     nc_rpc_free(rpc);
 
 finalize:
-    CHECK_AND_FREE(target);
-    CHECK_AND_FREE(url);
+    CHECK_AND_FREE(persist);
+    CHECK_AND_FREE(persist_id);
+    return reply;
+}
+
+json_object *
+handle_op_cancel(json_object *request)
+{
+    json_object *reply;
+    char *id;
+    int count;
+
+    pthread_mutex_lock(&json_lock);
+    id = get_param_string(request, "request-id");
+    pthread_mutex_unlock(&json_lock);
+
+    DEBUG("Request: cancel (request-id %s)", id ? id : "none");
+
+    if (!id) {
+        return create_error_reply("Missing request-id parameter.");
+    }
+
+    count = request_cancel(id);
+    free(id);
+    if (!count) {
+        reply = create_error_reply("No such request is being processed.");
+    } else {
+        reply = create_ok_reply();
+    }
     return reply;
 }
 
+/**
+ * \brief Change the configuration of all the devices or none of them.
+ *
+ * Every device locks, edits and validates its candidate (pipelined) in parallel. If all of them
+ * succeed, they commit and unlock in parallel, otherwise all of them discard the changes and unlock.
+ * A confirmed commit is checked by a <get> probe on every device and then either confirmed
+ * or cancelled on all of them.
+ */
+static void
+handle_op_transaction(json_object *request, json_object *sessions, int count, json_object *replies,
+                      struct content_cache **conv_cache)
+{
+    struct group_params params = {NC_RPC_EDIT_DFLTOP_UNKNOWN, 0, 600, NULL, NULL};
+    struct group_device *devs;
+    char *defop = NULL, *format = NULL, *validate = NULL, *persist = NULL, *probe = NULL;
+    json_object *configs, *obj;
+    struct timespec start;
+    int i, failed = 0, sent = 0, probe_delay = 0;
+
+    DEBUG("Request: transaction (%d sessions)", count);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    devs = calloc(count, sizeof *devs);
+    if (!devs) {
+        add_reply(replies, create_error_reply("Memory allocation failed."), 0);
+        return;
+    }
+
+    pthread_mutex_lock(&json_lock);
+    defop = get_param_string(request, "default-operation");
+    format = get_param_string(request, "format");
+    validate = get_param_string(request, "validate");
+    persist = get_param_string(request, "persist");
+    probe = get_param_string(request, "probe");
+    if (json_object_object_get_ex(request, "confirmed", &obj) == TRUE) {
+        params.confirmed = json_object_get_boolean(obj);
+    }
+    if (json_object_object_get_ex(request, "confirm-timeout", &obj) == TRUE) {
+        params.confirm_timeout = json_object_get_int(obj);
+    }
+    if (json_object_object_get_ex(request, "probe-delay", &obj) == TRUE) {
+        probe_delay = json_object_get_int(obj);
+    }
+    if (json_object_object_get_ex(request, "configs", &configs) == FALSE) {
+        configs = NULL;
+    }
+    for (i = 0; i < count; ++i) {
+        devs[i].session_key = json_object_get_int(json_object_array_get_idx(sessions, i));
+        devs[i].timing = json_object_new_object();
+        devs[i].params = &params;
+        obj = configs ? json_object_array_get_idx(configs, i) : NULL;
+        devs[i].config = obj ? strdup(json_object_get_string(obj)) : NULL;
+    }
+    pthread_mutex_unlock(&json_lock);
+
+    params.persist = persist;
+    params.probe = probe;
+    if (defop) {
+        if (!strcmp(defop, "merge")) {
+            params.defop = NC_RPC_EDIT_DFLTOP_MERGE;
+        } else if (!strcmp(defop, "replace")) {
+            params.defop = NC_RPC_EDIT_DFLTOP_REPLACE;
+        } else if (!strcmp(defop, "none")) {
+            params.defop = NC_RPC_EDIT_DFLTOP_NONE;
+        } else {
+            for (i = 0; i < count; ++i) {
+                devs[i].reply = create_error_reply("Invalid default-operation parameter.");
+            }
+        }
+    }
+    if (params.confirmed && ((params.confirm_timeout < 1) || (probe_delay < 0)
+            || ((unsigned int)probe_delay >= params.confirm_timeout))) {
+        for (i = 0; i < count; ++i) {
+            if (!devs[i].reply) {
+                devs[i].reply = create_error_reply("Invalid confirm-timeout or probe-delay parameter.");
+            }
+        }
+    }
+
+    /* nothing is sent unless all the contents are fine */
+    for (i = 0; i < count; ++i) {
+        if (devs[i].reply) {
+            failed = 1;
+        } else if (!devs[i].config) {
+            devs[i].reply = create_error_reply("Configs array parameter shorter than sessions.");
+            failed = 1;
+        } else if (content_prepare(devs[i].session_key, &devs[i].config, format, validate, LYD_OPT_EDIT,
+                                   "edit-config", conv_cache, &devs[i].reply)) {
+            failed = 1;
+        }
+    }
+
+    if (!failed) {
+        sent = 1;
+        group_run(devs, count, group_step_prepare, 0);
+        failed = group_failed(devs, count);
+    }
+
+    if (!failed) {
+        group_run(devs, count, group_step_commit, 0);
+        if (params.confirmed) {
+            failed = group_failed(devs, count);
+            if (!failed) {
+                if (probe_delay && request_sleep(probe_delay * 1000)) {
+                    /* roll back the confirmed commit rather than leave it to expire */
+                    for (i = 0; i < count; ++i) {
+                        if (!devs[i].reply) {
+                            devs[i].reply = request_abandoned_reply();
+                        }
+                    }
+                } else {
+                    group_run(devs, count, group_step_probe, 0);
+                }
+                failed = group_failed(devs, count);
+            }
+            if (!failed) {
+                group_run(devs, count, group_step_confirm, 0);
+            }
+        }
+    }
+
+    if (failed) {
+        if (sent) {
+            DEBUG("Transaction failed, rolling back.");
+            group_run(devs, count, group_step_rollback, 1);
+        }
+        for (i = 0; i < count; ++i) {
+            if (!devs[i].reply) {
+                devs[i].reply = create_error_reply("Transaction failed on another device.");
+            }
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        group_device_timing(&devs[i], "total", &start);
+        if (!devs[i].reply) {
+            devs[i].reply = create_ok_reply();
+        }
+        pthread_mutex_lock(&json_lock);
+        json_object_object_add(devs[i].reply, "timing", devs[i].timing);
+        pthread_mutex_unlock(&json_lock);
+        add_reply(replies, devs[i].reply, devs[i].session_key);
+        free(devs[i].config);
+    }
+
+    free(devs);
+    free(defop);
+    free(format);
+    free(validate);
+    free(persist);
+    free(probe);
+}
+
 json_object *
 handle_op_query(json_object *request, unsigned int session_key, int idx)
 {
@@ -3316,12 +7498,13 @@ finalize:
 }
 
 json_object *
-handle_op_merge(json_object *request, unsigned int session_key, int idx)
+handle_op_merge(json_object *request, unsigned int session_key, int idx, struct content_cache **conv_cache)
 {
-    json_object *reply = NULL, *configs, *obj;
+    json_object *reply = NULL, *configs, *obj, *data;
     char *config = NULL;
-    struct lyd_node *content;
+    const char *merged;
     struct session_with_mutex *locked_session;
+    uint64_t schema;
 
     DEBUG("Request: merge (session %u)", session_key);
 
@@ -3345,19 +7528,27 @@ handle_op_merge(json_object *request, unsigned int session_key, int idx)
         ERROR("Unknown session or locking failed.");
         goto finalize;
     }
-
-    content = lyd_parse_mem(nc_session_get_ctx(locked_session->session), config, LYD_JSON, LYD_OPT_DATA);
+    schema = session_schema_hash(locked_session);
     session_unlock(locked_session);
 
-    free(config);
-    lyd_print_mem(&config, content, LYD_XML, LYP_WITHSIBLINGS);
-    lyd_free_withsiblings(content);
+    /* the merged metadata depend only on the schema */
+    if (conv_cache && (merged = content_cache_find(*conv_cache, schema, LYD_OPT_DATA, config))) {
+        DEBUG("Reusing merge result of another session.");
+        reply = create_data_reply(merged);
+        goto finalize;
+    }
 
     reply = libyang_merge(session_key, config);
 
     CHECK_ERR_SET_REPLY
     if (!reply) {
         reply = create_error_reply("Merge failed.");
+    } else {
+        pthread_mutex_lock(&json_lock);
+        if ((json_object_object_get_ex(reply, "data", &data) == TRUE)) {
+            content_cache_add(conv_cache, schema, LYD_OPT_DATA, config, json_object_get_string(data));
+        }
+        pthread_mutex_unlock(&json_lock);
     }
 
 finalize:
@@ -3365,6 +7556,133 @@ finalize:
     return reply;
 }
 
+/**
+ * \brief Process streamed <get> or <get-config> and write the replies directly to the client.
+ *
+ * The data are printed and written in chunks of STREAM_CHUNK_SIZE one top-level subtree
+ * at a time, so the serialized reply is never held in memory as a whole (the received
+ * data tree is, though).
+ *
+ * \return 0 on success, -1 if the reply was cut off and the client connection must be closed.
+ */
+static int
+stream_op_get(json_object *request, int operation, json_object *sessions, int count, int client)
+{
+    NC_DATASTORE ds_type_s = NC_DATASTORE_RUNNING;
+    struct chunk_writer *w;
+    struct nc_rpc *rpc = NULL;
+    struct lyd_node *data;
+    json_object *reply = NULL, *obj;
+    char *filter = NULL, *source = NULL, *str;
+    const char *errmsg;
+    unsigned int session_key;
+    int i, strict = 0, ret;
+
+    DEBUG("Request: streamed %s", (operation == MSG_GET) ? "get" : "get-config");
+    errmsg = (operation == MSG_GET) ? "Get information failed." : "Get configuration operation failed.";
+
+    w = malloc(sizeof *w);
+    if (!w) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return -1;
+    }
+    w->fd = client;
+    w->failed = 0;
+    w->len = 0;
+
+    /* the same validation as of the non-streamed requests */
+    pthread_mutex_lock(&json_lock);
+    filter = get_param_string(request, "filter");
+    source = get_param_string(request, "source");
+    if (json_object_object_get_ex(request, "strict", &obj) == FALSE) {
+        reply = create_error_reply("Missing strict parameter.");
+    } else {
+        strict = json_object_get_boolean(obj);
+    }
+    pthread_mutex_unlock(&json_lock);
+
+    if (operation == MSG_GETCONFIG) {
+        ds_type_s = source ? parse_datastore(source) : (NC_DATASTORE)-1;
+    }
+
+    if (reply) {
+        /* common for all the sessions */
+        ds_type_s = (NC_DATASTORE)-1;
+    } else if ((int)ds_type_s == -1) {
+        reply = create_error_reply("Invalid source repository type requested.");
+    } else if (operation == MSG_GET) {
+        reply = NULL;
+        rpc = nc_rpc_get(filter, 0, NC_PARAMTYPE_CONST);
+    } else {
+        reply = NULL;
+        rpc = getconfig_rpc_create(ds_type_s, filter);
+    }
+
+    chunk_write(w, "{", 1);
+    for (i = 0; i < count; ++i) {
+        pthread_mutex_lock(&json_lock);
+        session_key = json_object_get_int(json_object_array_get_idx(sessions, i));
+        pthread_mutex_unlock(&json_lock);
+
+        asprintf(&str, "%s\"%u\":", i ? "," : "", session_key);
+        chunk_write(w, str, strlen(str));
+        free(str);
+
+        data = NULL;
+        clean_err_reply();
+        if (!reply) {
+            reply = netconf_op(session_key, rpc, strict, &data);
+            if (!reply && !data) {
+                CHECK_ERR_SET_REPLY_ERR(errmsg)
+            }
+        }
+
+        if (reply) {
+            pthread_mutex_lock(&json_lock);
+            str = strdup(json_object_to_json_string(reply));
+            if ((int)ds_type_s != -1) {
+                /* only the invalid datastore error is common for all the sessions */
+                json_object_put(reply);
+                reply = NULL;
+            }
+            pthread_mutex_unlock(&json_lock);
+            chunk_write(w, str, strlen(str));
+            free(str);
+            continue;
+        }
+
+        asprintf(&str, "{\"type\":%d,\"data\":", REPLY_DATA);
+        chunk_write(w, str, strlen(str));
+        free(str);
+        if (chunk_write_data(w, data)) {
+            /* the data string is incomplete, there is no way to finish the reply */
+            ERROR("Streaming %s reply of session %u failed, aborting it.",
+                  (operation == MSG_GET) ? "get" : "get-config", session_key);
+            w->failed = 1;
+            break;
+        }
+        chunk_write(w, "}", 1);
+    }
+    chunk_write(w, "}", 1);
+    chunk_flush(w);
+    if (!w->failed && send_all(client, "\n##\n", 4)) {
+        w->failed = 1;
+    }
+    ret = w->failed ? -1 : 0;
+
+    if (reply) {
+        pthread_mutex_lock(&json_lock);
+        json_object_put(reply);
+        pthread_mutex_unlock(&json_lock);
+    }
+    nc_rpc_free(rpc);
+    free(filter);
+    free(source);
+    free(w);
+    clean_err_reply();
+    return ret;
+}
+
 void *
 thread_routine(void *arg)
 {
@@ -3373,10 +7691,11 @@ thread_routine(void *arg)
     json_object *request = NULL, *replies = NULL, *reply, *sessions = NULL;
     json_object *js_tmp = NULL;
     int operation = (-1), count, i, sent;
-    int status = 0;
+    int status = 0, streamed = 0;
     const char *msgtext;
     unsigned int session_key = 0;
     char *chunked_out_msg = NULL;
+    struct content_cache *conv_cache = NULL;
     int client = ((struct pass_to_thread *)arg)->client;
 
     char *buffer = NULL;
@@ -3436,7 +7755,7 @@ thread_routine(void *arg)
                 goto send_reply;
             }
 
-            if ((operation < 4) || ((operation > 20) && (operation < 100)) || (operation > 101)) {
+            if ((operation < 4) || ((operation > MSG_CANCEL) && (operation < 100)) || (operation > 101)) {
                 DEBUG("Unknown mod_netconf operation requested (%d)", operation);
                 replies = create_replies();
                 add_reply(replies, create_error_reply("Operation not supported."), 0);
@@ -3447,6 +7766,7 @@ thread_routine(void *arg)
 
             /* null global JSON error-reply */
             clean_err_reply();
+            request_begin(request, operation);
 
             /* clean replies envelope */
             if (replies != NULL) {
@@ -3456,7 +7776,7 @@ thread_routine(void *arg)
             }
             replies = create_replies();
 
-            if (operation == MSG_CONNECT) {
+            if ((operation == MSG_CONNECT) || (operation == MSG_CANCEL)) {
                 count = 1;
             } else {
                 pthread_mutex_lock(&json_lock);
@@ -3466,11 +7786,31 @@ thread_routine(void *arg)
                     goto send_reply;
                 }
                 count = json_object_array_length(sessions);
-                pthread_mutex_unlock(&json_lock);
+                if (operation == MSG_TRANSACTION) {
+                    /* all the sessions together */
+                    pthread_mutex_unlock(&json_lock);
+                    handle_op_transaction(request, sessions, count, replies, &conv_cache);
+                    count = 0;
+                } else if (((operation == MSG_GETCONFIG)
+                            || ((operation == MSG_GET) && (json_object_object_get_ex(request, "list", &js_tmp) == FALSE)))
+                        && (json_object_object_get_ex(request, "stream", &js_tmp) == TRUE)
+                        && json_object_get_boolean(js_tmp)) {
+                    pthread_mutex_unlock(&json_lock);
+                    streamed = stream_op_get(request, operation, sessions, count, client) ? -1 : 1;
+                    count = 0;
+
+                    /* the replies were already sent */
+                    pthread_mutex_lock(&json_lock);
+                    json_object_put(replies);
+                    pthread_mutex_unlock(&json_lock);
+                    replies = NULL;
+                } else {
+                    pthread_mutex_unlock(&json_lock);
+                }
             }
 
             for (i = 0; i < count; ++i) {
-                if (operation != MSG_CONNECT) {
+                if ((operation != MSG_CONNECT) && (operation != MSG_CANCEL)) {
                     js_tmp = json_object_array_get_idx(sessions, i);
                     session_key = json_object_get_int(js_tmp);
                 }
@@ -3491,10 +7831,10 @@ thread_routine(void *arg)
                     reply = handle_op_getconfig(request, session_key);
                     break;
                 case MSG_EDITCONFIG:
-                    reply = handle_op_editconfig(request, session_key, i);
+                    reply = handle_op_editconfig(request, session_key, i, &conv_cache);
                     break;
                 case MSG_COPYCONFIG:
-                    reply = handle_op_copyconfig(request, session_key, i);
+                    reply = handle_op_copyconfig(request, session_key, i, &conv_cache);
                     break;
                 case MSG_DELETECONFIG:
                     reply = handle_op_deleteconfig(request, session_key);
@@ -3512,7 +7852,7 @@ thread_routine(void *arg)
                     reply = handle_op_info(request, session_key);
                     break;
                 case MSG_GENERIC:
-                    reply = handle_op_generic(request, session_key, i);
+                    reply = handle_op_generic(request, session_key, i, &conv_cache);
                     break;
                 case MSG_GETSCHEMA:
                     reply = handle_op_getschema(request, session_key);
@@ -3527,13 +7867,19 @@ thread_routine(void *arg)
                     reply = handle_op_validate(request, session_key);
                     break;
                 case MSG_COMMIT:
-                    reply = handle_op_commit(session_key);
+                    reply = handle_op_commit(request, session_key);
+                    break;
+                case MSG_DESIREDCONFIG:
+                    reply = handle_op_desiredconfig(request, session_key, i);
+                    break;
+                case MSG_CANCEL:
+                    reply = handle_op_cancel(request);
                     break;
                 case SCH_QUERY:
                     reply = handle_op_query(request, session_key, i);
                     break;
                 case SCH_MERGE:
-                    reply = handle_op_merge(request, session_key, i);
+                    reply = handle_op_merge(request, session_key, i, &conv_cache);
                     break;
                 }
 
@@ -3542,6 +7888,8 @@ thread_routine(void *arg)
 
             /* free parameters */
             operation = (-1);
+            content_cache_free(conv_cache);
+            conv_cache = NULL;
 
             if (request != NULL) {
                 pthread_mutex_lock(&json_lock);
@@ -3551,6 +7899,8 @@ thread_routine(void *arg)
             }
 
 send_reply:
+            request_end();
+
             /* send reply to caller */
             if (replies) {
                 pthread_mutex_lock(&json_lock);
@@ -3587,6 +7937,14 @@ send_reply:
                     buffer = NULL;
                 }
                 clean_err_reply();
+            } else if (streamed) {
+                CHECK_AND_FREE(buffer);
+                if (streamed == -1) {
+                    /* the reply was cut off, the client cannot get in sync again */
+                    close(client);
+                    break;
+                }
+                streamed = 0;
             } else {
                 ERROR("Reply is NULL, shouldn't be...");
                 continue;
@@ -3699,6 +8057,7 @@ forked_proc(void)
     struct timeval tv;
     struct sockaddr_un local, remote;
     int lsock, client, ret, i, pthread_count = 0;
+    struct pollfd lpoll;
     unsigned int olds = 0, timediff = 0;
     socklen_t len;
     struct pass_to_thread *arg;
@@ -3800,6 +8159,10 @@ forked_proc(void)
     #ifdef WITH_NOTIFICATIONS
     if (notification_init() == -1) {
         ERROR("libwebsockets initialization failed");
+        notification_close();
+        use_notifications = 0;
+    } else if (notification_start() == -1) {
+        notification_close();
         use_notifications = 0;
     } else {
         use_notifications = 1;
@@ -3829,6 +8192,13 @@ forked_proc(void)
     }
     pthread_mutex_init(&ntf_history_lock, NULL);
     pthread_mutex_init(&json_lock, NULL);
+    pthread_mutex_init(&query_cache_lock, NULL);
+    pthread_mutex_init(&schema_bundles_lock, NULL);
+    pthread_mutex_init(&read_requests_lock, NULL);
+    pthread_cond_init(&read_requests_cond, NULL);
+    pthread_mutex_init(&commit_batches_lock, NULL);
+    pthread_mutex_init(&requests_lock, NULL);
+    pthread_cond_init(&commit_batches_cond, NULL);
     DEBUG("Initialization of notification history.");
     if (pthread_key_create(&notif_history_key, NULL) != 0) {
         ERROR("Initialization of notification history failed.");
@@ -3836,16 +8206,14 @@ forked_proc(void)
     if (pthread_key_create(&err_reply_key, NULL) != 0) {
         ERROR("Initialization of reply key failed.");
     }
+    if (pthread_key_create(&request_ctx_key, NULL) != 0) {
+        ERROR("Initialization of request key failed.");
+    }
 
     fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL, 0) | O_NONBLOCK);
     while (isterminated == 0) {
         gettimeofday(&tv, NULL);
         timediff = (unsigned int)tv.tv_sec - olds;
-        #ifdef WITH_NOTIFICATIONS
-        if (use_notifications == 1) {
-            notification_handle();
-        }
-        #endif
         if (timediff > ACTIVITY_CHECK_INTERVAL) {
             check_timeout_and_close();
         }
@@ -3854,7 +8222,11 @@ forked_proc(void)
         len = sizeof(remote);
         client = accept(lsock, (struct sockaddr *) &remote, &len);
         if (client == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            usleep(SLEEP_TIME * 1000);
+            /* wait for the next connection, the websocket service has its own thread */
+            lpoll.fd = lsock;
+            lpoll.events = POLLIN;
+            lpoll.revents = 0;
+            poll(&lpoll, 1, SLEEP_TIME);
             continue;
         } else if (client == -1 && (errno == EINTR)) {
             continue;
@@ -3900,13 +8272,16 @@ forked_proc(void)
         pthread_timedjoin_np(ptids[i], (void **)&arg, &maxtime);
     }
 
+    /* close all NETCONF sessions, their notification threads stop */
+    close_all_nc_sessions();
+
     #ifdef WITH_NOTIFICATIONS
-    notification_close();
+    if (use_notifications == 1) {
+        /* the websocket clients release the sessions they still hold */
+        notification_close();
+    }
     #endif
 
-    /* close all NETCONF sessions */
-    close_all_nc_sessions();
-
     /* destroy rwlock */
     pthread_rwlock_destroy(&session_lock);
     pthread_rwlockattr_destroy(&lock_attrs);
@@ -61,20 +61,130 @@
  */
 #define CHECK_AND_FREE(pointer) if (pointer != NULL) { free(pointer); pointer = NULL; }
 
+/**
+ * \brief Immutable websocket frame of a notification, built once when it is received and
+ * shared by all the clients sending it
+ */
+struct notif_frame {
+    unsigned int refs;          /**< reference count */
+    uint32_t match;             /**< local filters the notification matches, bit per filter index */
+    size_t len;                 /**< payload length */
+    unsigned char *payload;     /**< payload, preceded by the space for the websocket header */
+    unsigned char data[];
+};
+
 typedef struct notification {
     time_t eventtime;
-    char* content;
+    struct notif_frame *frame;
 } notification_t;
 
+/**
+ * \brief Lock-free ring of received notifications with a single producer (the notification
+ * thread of the session) and a single consumer (the websocket service)
+ */
+struct notif_ring {
+    notification_t *slots;
+    unsigned int size;          /**< number of slots */
+    unsigned int head;          /**< count of pushed notifications, written only by the producer */
+    unsigned int tail;          /**< count of removed notifications */
+    unsigned long dropped;      /**< count of notifications dropped because the ring was full */
+    int signalled;              /**< the websocket service was woken up and did not drain the ring yet */
+};
+
+/**
+ * \brief Maximum number of distinct local notification filters of a session (bits of notif_frame match)
+ */
+#define NOTIF_FILTER_MAX 32
+
+/**
+ * \brief Maximum number of replies of timed out or cancelled RPCs of a session waiting to be dropped
+ */
+#define ABANDONED_REPLY_MAX 32
+
+/**
+ * \brief XPath filter of the websocket clients of a session, evaluated on every received notification
+ */
+struct notif_filter {
+    char *xpath;                /**< filter, NULL if the slot is free */
+    unsigned int refs;          /**< number of clients using it */
+};
+
+/**
+ * \brief Precompiled SCH_QUERY result (with load_children) of a whole module
+ */
+struct schema_bundle {
+    char *module;           /**< module name */
+    unsigned char *data;    /**< zlib-compressed serialized query result */
+    size_t len;             /**< length of the uncompressed result */
+    size_t clen;            /**< length of data */
+};
+
+/**
+ * \brief Precompiled bundles shared by all the sessions with the same schema
+ */
+struct schema_bundle_set {
+    uint64_t schema_hash;   /**< fingerprint of the schema the bundles were built from */
+    unsigned int refs;      /**< number of sessions using the set */
+    struct schema_bundle *bundles;
+    unsigned int count;
+    char building;          /**< a session thread is precompiling the bundles */
+    char complete;          /**< all the modules are precompiled */
+    struct schema_bundle_set *next;
+};
+
+/**
+ * \brief Cached annotated <get-config> reply
+ */
+struct config_cache {
+    NC_DATASTORE source;    /**< datastore */
+    int strict;             /**< strict parameter of the request */
+    char *filter;           /**< filter of the request, can be NULL */
+    char *data;             /**< reply data */
+    time_t stored;          /**< time the reply was received */
+    struct config_cache *next;
+};
+
+/**
+ * \brief Cached configuration data tree of a datastore
+ */
+struct config_tree {
+    struct lyd_node *tree;  /**< data tree */
+    unsigned int gen;       /**< configuration generation of the data */
+    time_t stored;          /**< time the data were received */
+};
+
 struct session_with_mutex {
     struct nc_session *session; /**< netconf session */
     unsigned int session_key;    /**< unique session identifier throughout all the sessions */
-    notification_t *notifications;
-    int notif_count;
+    uint64_t schema_hash;        /**< fingerprint of the modules in the session context */
+    uint16_t schema_set_id;      /**< module set ID of the context schema_hash was computed for */
+    struct notif_ring notif_ring; /**< received notifications waiting for the websocket client */
+    char *notif_stream;          /**< stream of the NETCONF subscription of the websocket clients, NULL for default */
+    char *notif_filter;          /**< filter of the NETCONF subscription of the websocket clients */
+    pthread_mutex_t notif_filters_lock; /**< mutex protecting the local notification filters */
+    struct notif_filter notif_filters[NOTIF_FILTER_MAX]; /**< distinct local filters of the websocket clients */
+    unsigned int notif_unfiltered; /**< number of websocket clients without a local filter */
     json_object *hello_message;
     char closed; /**< 0 when session is terminated */
+    unsigned int refs; /**< references of the structure, by the sessions list and the notification hubs */
     time_t last_activity;
     pthread_mutex_t lock; /**< mutex protecting the session from multiple access */
+    uint64_t abandoned[ABANDONED_REPLY_MAX]; /**< message IDs of the RPCs whose replies are to be dropped */
+    unsigned int abandoned_count;
+
+    pthread_mutex_t cache_lock; /**< mutex protecting cached data of the session */
+    struct schema_bundle_set *bundles; /**< precompiled module metadata, shared with sessions with the same schema */
+    pthread_t bundle_thread; /**< thread precompiling bundles */
+    char bundle_thread_running;
+    volatile char bundle_cancel; /**< set to stop bundle precompilation */
+    struct config_cache *config_cache; /**< cached <get-config> replies */
+    unsigned int config_gen; /**< incremented on every (possible) change of the device configuration */
+    struct config_tree config_trees[3]; /**< cached running, startup and candidate data trees */
+    struct lyd_node *delta_tree; /**< configuration last sent to the client requesting deltas */
+    NC_DATASTORE delta_source;
+    char *delta_filter;
+    int delta_strict;
+    unsigned int delta_version; /**< version token of delta_tree */
 
     struct session_with_mutex *prev;
     struct session_with_mutex *next;
@@ -117,6 +227,15 @@ if (daemonize) { \
     fprintf(stderr, "\n"); \
 }
 
+/* operational information, logged in all the builds unlike DEBUG */
+#define INFO(...) \
+if (daemonize) { \
+    syslog(LOG_INFO, __VA_ARGS__); \
+} else { \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, "\n"); \
+}
+
 #define GETSPEC_ERR_REPLY \
 json_object **err_reply_p = (json_object **) pthread_getspecific(err_reply_key); \
 json_object *err_reply = ((err_reply_p != NULL)?(*err_reply_p):NULL);
@@ -140,11 +259,20 @@ if (reply == NULL) { \
         reply = err_reply; \
     } \
 }
+void session_config_changed(struct session_with_mutex *locked_session);
+void session_ref(struct session_with_mutex *locked_session);
+void session_unref(struct session_with_mutex *locked_session);
+int notif_ring_init(struct notif_ring *ring, unsigned int size);
+struct notif_frame *notif_frame_get(struct notif_frame *frame);
+void notif_frame_put(struct notif_frame *frame);
+void notif_ring_push(struct notif_ring *ring, time_t eventtime, struct notif_frame *frame);
+int notif_ring_pop(struct notif_ring *ring, notification_t *notif);
+void notif_ring_clean(struct notif_ring *ring);
 void create_err_reply_p();
 void clean_err_reply();
 void free_err_reply();
 
 NC_MSG_TYPE netconf_send_recv_timed(struct nc_session *session, struct nc_rpc *rpc, int timeout,
-                                    int strict, struct nc_reply **reply);
+                                    int strict, struct nc_reply **reply, uint64_t *abandoned);
 
 #endif
@@ -0,0 +1,268 @@
+/*!
+ * \file notification-bench.c
+ * \brief Throughput benchmark of the websocket notification delivery, batched or unbatched
+ */
+/*
+ * Copyright (C) 2016 CESNET
+ *
+ * LICENSE TERMS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is'', and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libwebsockets.h>
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT 8080
+#define DEFAULT_TIME 10
+
+/* the connection of the measured protocol */
+struct bench_conn {
+    const char *label;
+    struct lws *wsi;
+    char established;
+    char closed;
+    char *msg;              /* message being received */
+    size_t msg_len;
+    unsigned long events;   /* received notifications */
+    unsigned long dropped;  /* notifications reported as dropped */
+    unsigned long frames;   /* received messages */
+    unsigned long long bytes;
+};
+
+static struct bench_conn conn;
+static char subscribe_msg[1024];
+
+void print_help(char* progname)
+{
+    printf("Usage: %s [-a <host>] [-p <port>] [-t <seconds>] [-b] [-n] <session-id> [<stream>|- [<filter>]]\n", progname);
+    printf("Subscribes to the notifications of a NETCONF session connected by netopeerguid over\n");
+    printf("notification-protocol (or notification-batch-protocol) and reports the number of received\n");
+    printf("notifications per second. Session ID 0 is the synthetic session of netopeerguid built with\n");
+    printf("NOTIFICATION_BENCH, it sends notifications as fast as the client receives them.\n");
+    printf("\t-a <host>\tnotification server address (default %s)\n", DEFAULT_HOST);
+    printf("\t-p <port>\tnotification server port (default %d)\n", DEFAULT_PORT);
+    printf("\t-t <seconds>\tduration of the measurement (default %d)\n", DEFAULT_TIME);
+    printf("\t-b\tuse notification-batch-protocol\n");
+    printf("\t-n\tdo not use TLS\n");
+}
+
+/**
+ * \brief Count the notifications and the dropped ones in a received message, an object or an array of objects.
+ */
+static void
+count_notifications(struct bench_conn *c, const char *msg)
+{
+    const char *iter;
+
+    for (iter = msg; (iter = strstr(iter, "{\"eventtime\":")); ++iter) {
+        ++c->events;
+    }
+    /* {"dropped":N} or [{"dropped":N}] */
+    for (iter = msg; (iter = strstr(iter, "{\"dropped\":")); ++iter) {
+        c->dropped += strtoul(iter + 11, NULL, 10);
+    }
+}
+
+static int
+callback_bench(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+{
+    unsigned char buf[LWS_PRE + sizeof subscribe_msg];
+    struct bench_conn *c = &conn;
+    char *msg;
+    int n;
+    (void)user;
+
+    if (c->wsi != wsi) {
+        return 0;
+    }
+
+    switch (reason) {
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+        c->established = 1;
+        lws_callback_on_writable(wsi);
+        break;
+    case LWS_CALLBACK_CLIENT_WRITEABLE:
+        /* the subscribe message */
+        n = strlen(subscribe_msg);
+        memcpy(&buf[LWS_PRE], subscribe_msg, n);
+        if (lws_write(wsi, &buf[LWS_PRE], n, LWS_WRITE_TEXT) < n) {
+            return -1;
+        }
+        break;
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+        msg = realloc(c->msg, c->msg_len + len + 1);
+        if (msg == NULL) {
+            return -1;
+        }
+        c->msg = msg;
+        memcpy(&c->msg[c->msg_len], in, len);
+        c->msg_len += len;
+        c->bytes += len;
+        if (lws_is_final_fragment(wsi) && !lws_remaining_packet_payload(wsi)) {
+            c->msg[c->msg_len] = '\0';
+            count_notifications(c, c->msg);
+            ++c->frames;
+            c->msg_len = 0;
+        }
+        break;
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+    case LWS_CALLBACK_CLOSED:
+        c->closed = 1;
+        c->wsi = NULL;
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static struct lws_protocols protocols[] = {
+    { "notification-protocol", callback_bench, 0, 64 * 1024, 0, NULL },
+    { "notification-batch-protocol", callback_bench, 0, 64 * 1024, 1, NULL },
+    { NULL, NULL, 0, 0, 0, NULL } /* terminator */
+};
+
+static double
+elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    struct lws_context_creation_info info;
+    struct lws_client_connect_info ci;
+    struct lws_context *context;
+    struct timespec start;
+    const char *host = DEFAULT_HOST;
+    int port = DEFAULT_PORT, duration = DEFAULT_TIME, ssl = 1, batch = 0, opt;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "a:p:t:bnh")) != -1) {
+        switch (opt) {
+        case 'a':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'n':
+            ssl = 0;
+            break;
+        default:
+            print_help(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* "<session-id> <start> <stop> [<stream> [<filter>]]" */
+    snprintf(subscribe_msg, sizeof subscribe_msg, "%s -1 0%s%s%s%s", argv[optind],
+             (optind + 1 < argc) ? " " : "", (optind + 1 < argc) ? argv[optind + 1] : "",
+             (optind + 2 < argc) ? " " : "", (optind + 2 < argc) ? argv[optind + 2] : "");
+
+    lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+    memset(&info, 0, sizeof info);
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    info.gid = -1;
+    info.uid = -1;
+    info.options = ssl ? LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT : 0;
+    context = lws_create_context(&info);
+    if (context == NULL) {
+        fprintf(stderr, "Creating libwebsockets context failed.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* one protocol per run, so the modes do not compete for the service */
+    conn.label = batch ? "batched" : "unbatched";
+    memset(&ci, 0, sizeof ci);
+    ci.context = context;
+    ci.address = host;
+    ci.port = port;
+    ci.ssl_connection = ssl ? (LCCSCF_USE_SSL | LCCSCF_ALLOW_SELF_SIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK) : 0;
+    ci.path = "/";
+    ci.host = host;
+    ci.origin = host;
+    ci.protocol = protocols[batch].name;
+    ci.ietf_version_or_minus_one = -1;
+    conn.wsi = lws_client_connect_via_info(&ci);
+    if (conn.wsi == NULL) {
+        fprintf(stderr, "Connecting %s client failed.\n", conn.label);
+        lws_context_destroy(context);
+        return EXIT_FAILURE;
+    }
+
+    /* the measurement starts when the client is subscribed */
+    while (!conn.established) {
+        if (conn.closed) {
+            fprintf(stderr, "Connection to the notification server failed.\n");
+            lws_context_destroy(context);
+            return EXIT_FAILURE;
+        }
+        lws_service(context, 50);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((elapsed(&start) < duration) && !conn.closed) {
+        lws_service(context, 50);
+    }
+    secs = elapsed(&start);
+
+    printf("%-10s %12s %12s %12s %12s %12s %14s\n", "mode", "events", "dropped", "frames", "events/s", "frames/s",
+           "bytes");
+    printf("%-10s %12lu %12lu %12lu %12.0f %12.0f %14llu%s\n", conn.label, conn.events, conn.dropped, conn.frames,
+           conn.events / secs, conn.frames / secs, conn.bytes, conn.closed ? " (closed)" : "");
+
+    lws_context_destroy(context);
+    free(conn.msg);
+    return EXIT_SUCCESS;
+}
@@ -26,6 +26,8 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
@@ -39,6 +41,9 @@
 #include "netopeerguid.h"
 #include "../config.h"
 
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
 #ifdef TEST_NOTIFICATION_SERVER
 static int force_exit = 0;
 #endif
@@ -50,6 +55,66 @@ static struct pollfd *pollfds;
 static int *fd_lookup;
 static int count_pollfds;
 static struct lws_context *context = NULL;
+static pthread_t service_thread;
+static int service_running = 0;
+static int service_stop = 0;
+
+/* wakeup of the websocket service by the notification threads */
+static int wake_fd = -1;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int *wake_sids;         /* sessions with new notifications */
+static unsigned int wake_count, wake_size;
+
+/*
+ * Notifications of a session shared by all its websocket clients, each with its own cursor.
+ * The queue of the session is drained into its hub and both the hubs and the clients are
+ * accessed only by the websocket service. The hub holds a reference of the session, so its
+ * lock-free queue is drained without locking the session.
+ */
+struct notif_hub {
+    struct session_with_mutex *session;
+    unsigned int sid;               /* NETCONF session ID */
+    notification_t *slots;
+    unsigned int size;
+    unsigned long head;             /* sequence number of the next notification */
+    unsigned long ring_dropped;     /* dropped count of the session queue already accounted */
+    unsigned long lost;             /* notifications dropped from the session queue */
+    unsigned int clients;
+    struct notif_hub *next;
+};
+static struct notif_hub *hubs;
+
+/*
+ * Subscription of a websocket client. The session is looked up and the NETCONF subscription
+ * created by a worker thread, the websocket service attaches the client once it is done.
+ */
+struct notif_sub_job {
+    struct per_session_data__notif_client *pss; /* NULL once the client is closed */
+    char *session_id;
+    char *params;                   /* subscribe message after the session ID */
+    struct session_with_mutex *ls;  /* session with a reference, NULL if not found */
+    unsigned int sid;
+    int filter;                     /* registered local filter, -1 if none */
+    int created;                    /* the NETCONF subscription was created for the client */
+    int ret;                        /* 0 on success, -1 to close the client */
+    const char *refusal;            /* close reason of a refused client */
+    struct notif_sub_job *next;
+};
+static struct notif_sub_job *sub_done;  /* finished subscriptions, protected by wake_lock */
+
+static void notif_client_attach(struct notif_sub_job *job);
+
+#if NOTIFICATION_BENCH
+/* synthetic session of notification-bench, its hub is topped up whenever a client is writeable */
+static struct session_with_mutex bench_session = {
+    .refs = 1,
+    .notif_filters_lock = PTHREAD_MUTEX_INITIALIZER
+};
+static struct notif_frame *bench_frame;
+#endif
+
+/* notification clients with a session */
+static struct per_session_data__notif_client *subscribers;
 
 extern struct session_with_mutex *netconf_sessions_list;
 static pthread_key_t thread_key;
@@ -58,6 +123,7 @@ enum demo_protocols {
     /* always first */
     PROTOCOL_HTTP = 0,
     PROTOCOL_NOTIFICATION,
+    PROTOCOL_NOTIFICATION_BATCH,
     /* always last */
     DEMO_PROTOCOL_COUNT
 };
@@ -390,6 +456,32 @@ struct per_session_data__notif_client {
     int number;
     char *session_id;
     struct nc_session *session;
+    struct lws *wsi;
+    struct per_session_data__notif_client *next;   /**< next client in the subscribers list */
+    struct notif_hub *hub;          /**< notifications of the session shared by its clients */
+    struct notif_sub_job *job;      /**< subscription being created for the client */
+    char refused;                   /**< the subscription failed, the client is closed when writeable */
+    const char *refusal;            /**< close reason of a refused client, can be NULL */
+    int filter;                     /**< index of the local filter (NOTIF_FILTER_MAX for none), -1 if not registered */
+    unsigned long cursor;           /**< sequence number of the next notification to send */
+    unsigned long lost_seen;        /**< lost count of the hub already reported to the client */
+    unsigned long missed;           /**< number of notifications the client missed */
+    unsigned long sent;             /**< number of sent notifications */
+    unsigned long long bytes;       /**< number of sent bytes */
+    unsigned long choked;           /**< number of times the pipe was choked with notifications waiting */
+    unsigned long max_backlog;      /**< maximum number of notifications waiting for the client */
+    unsigned long frames;           /**< number of sent frames */
+    char batch;                     /**< notifications are sent in batches (JSON array frames) */
+    char batch_armed;               /**< writeable callback requested to send the due batch */
+    unsigned long long batch_due;   /**< time (in ms) the waiting batch is sent, 0 if none waits */
+    unsigned char *batch_buf;       /**< batch frame buffer of NOTIFICATION_BATCH_SIZE, starts with LWS_PRE bytes */
+    struct notif_frame *stream;     /**< notification being sent in fragments */
+    size_t stream_off;              /**< bytes of the message with the notification already sent */
+    unsigned char *frag_buf;        /**< fragment buffer of NOTIFICATION_FRAGMENT_SIZE, starts with LWS_PRE bytes */
+    char deflate;                   /**< the message being sent is compressed (if permessage-deflate is negotiated) */
+    char deflate_bypass;            /**< the frame being sent bypasses permessage-deflate */
+    unsigned long long deflate_in;  /**< bytes of messages passed to permessage-deflate */
+    unsigned long long deflate_out; /**< bytes of messages after permessage-deflate */
 };
 
 static struct session_with_mutex *
@@ -402,7 +494,7 @@ get_ncsession_from_sid(const char *session_id)
     }
 
     for (locked_session = netconf_sessions_list;
-         locked_session && (nc_session_get_id(locked_session->session) == (unsigned)atoi(session_id));
+         locked_session && (nc_session_get_id(locked_session->session) != (unsigned)atoi(session_id));
          locked_session = locked_session->next);
     return locked_session;
 }
@@ -416,7 +508,7 @@ send_recv_process(struct nc_session *session, const char* UNUSED(operation), str
     int ret = EXIT_SUCCESS;
 
     /* send the request and get the reply */
-    switch (netconf_send_recv_timed(session, rpc, 50000, 0, &reply)) {
+    switch (netconf_send_recv_timed(session, rpc, RPC_TIMEOUT_OTHER, 0, &reply, NULL)) {
     case NC_MSG_ERROR:
         if (nc_session_get_status(session) != NC_STATUS_RUNNING) {
             ERROR("notifications: receiving rpc-reply failed.");
@@ -461,81 +553,351 @@ send_recv_process(struct nc_session *session, const char* UNUSED(operation), str
     return (ret);
 }
 
+/**
+ * \brief Find the session of a notification thread, it is looked up only for the first notification.
+ */
+static struct session_with_mutex *
+notif_thread_session(struct nc_session *session)
+{
+    struct session_with_mutex *locked_session;
+
+    locked_session = pthread_getspecific(thread_key);
+    if (locked_session) {
+        return locked_session;
+    }
+
+    /* the session is freed only after its notification thread terminates */
+    if (pthread_rwlock_rdlock(&session_lock) != 0) {
+        ERROR("notifications: Error while locking rwlock");
+        return NULL;
+    }
+    for (locked_session = netconf_sessions_list;
+         locked_session && (locked_session->session != session);
+         locked_session = locked_session->next);
+    if (pthread_rwlock_unlock(&session_lock) != 0) {
+        ERROR("notifications: Error while unlocking rwlock");
+    }
+
+    if (locked_session && (pthread_setspecific(thread_key, locked_session) != 0)) {
+        ERROR("notifications: cannot set thread-specific value.");
+    }
+    return locked_session;
+}
+
+void
+notification_wakeup(unsigned int sid)
+{
+    uint64_t one = 1;
+    unsigned int *new_sids;
+
+    /* notification_close() tears it down under the lock */
+    pthread_mutex_lock(&wake_lock);
+    if (wake_fd == -1) {
+        pthread_mutex_unlock(&wake_lock);
+        return;
+    }
+    if (wake_count == wake_size) {
+        new_sids = realloc(wake_sids, (wake_size ? wake_size * 2 : 8) * sizeof *wake_sids);
+        if (!new_sids) {
+            pthread_mutex_unlock(&wake_lock);
+            ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+            return;
+        }
+        wake_sids = new_sids;
+        wake_size = wake_size ? wake_size * 2 : 8;
+    }
+    wake_sids[wake_count++] = sid;
+    if (write(wake_fd, &one, sizeof one) != sizeof one) {
+        ERROR("notifications: cannot wake up the websocket service (%s).", strerror(errno));
+    }
+    pthread_mutex_unlock(&wake_lock);
+}
+
+/**
+ * \brief Wake up the websocket service to send new notifications of a session, called by the
+ * notification thread. The session is signalled again only after its clients drained the ring.
+ */
+static void
+notif_wakeup(struct notif_ring *ring, unsigned int sid)
+{
+    if (!__atomic_exchange_n(&ring->signalled, 1, __ATOMIC_ACQ_REL)) {
+        notification_wakeup(sid);
+    }
+}
+
+/**
+ * \brief Request writeable callback for the clients of the signalled sessions and attach the clients
+ * with finished subscriptions, only in the websocket service.
+ */
+static void
+notif_wakeup_process(void)
+{
+    struct per_session_data__notif_client *pss;
+    struct notif_sub_job *jobs, *next;
+    unsigned int *sids, count, i;
+    uint64_t value;
+
+    if (read(wake_fd, &value, sizeof value) != sizeof value) {
+        return;
+    }
+
+    pthread_mutex_lock(&wake_lock);
+    sids = wake_sids;
+    count = wake_count;
+    wake_sids = NULL;
+    wake_count = wake_size = 0;
+    jobs = sub_done;
+    sub_done = NULL;
+    pthread_mutex_unlock(&wake_lock);
+
+    for (; jobs; jobs = next) {
+        next = jobs->next;
+        notif_client_attach(jobs);
+    }
+
+    for (i = 0; (i < count) && !service_stop; ++i) {
+        for (pss = subscribers; pss; pss = pss->next) {
+            if (pss->hub && (pss->hub->sid == sids[i])) {
+                lws_callback_on_writable(pss->wsi);
+            }
+        }
+    }
+    free(sids);
+}
+
+/**
+ * \brief Remove a client from the subscribers list.
+ */
+static void
+notif_subscriber_remove(struct per_session_data__notif_client *pss)
+{
+    struct per_session_data__notif_client **iter;
+
+    for (iter = &subscribers; *iter; iter = &(*iter)->next) {
+        if (*iter == pss) {
+            *iter = pss->next;
+            break;
+        }
+    }
+    pss->next = NULL;
+}
+
+/**
+ * \brief Length of a string escaped as a JSON string (without the quotes), write it if out is set.
+ */
+static size_t
+notif_json_escape(const char *str, unsigned char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *c;
+    size_t len = 0;
+
+    for (c = (const unsigned char *)str; *c; ++c) {
+        if ((*c == '"') || (*c == '\\')) {
+            if (out) {
+                out[len] = '\\';
+                out[len + 1] = *c;
+            }
+            len += 2;
+        } else if (*c < 0x20) {
+            if (out) {
+                sprintf((char *)&out[len], "\\u00%c%c", hex[*c >> 4], hex[*c & 0xf]);
+            }
+            len += 6;
+        } else {
+            if (out) {
+                out[len] = *c;
+            }
+            ++len;
+        }
+    }
+    return len;
+}
+
+/**
+ * \brief Build the websocket frame {"eventtime":<time>,"content":"<content>"} of a notification.
+ *
+ * \return Frame with one reference, NULL on error.
+ */
+static struct notif_frame *
+notif_frame_create(time_t eventtime, const char *content)
+{
+    struct notif_frame *frame;
+    char head[64];
+    size_t head_len, content_len;
+
+    head_len = sprintf(head, "{\"eventtime\":%lld,\"content\":\"", (long long)eventtime);
+    content_len = notif_json_escape(content, NULL);
+
+    frame = malloc(sizeof *frame + LWS_PRE + head_len + content_len + 2);
+    if (!frame) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return NULL;
+    }
+    frame->refs = 1;
+    frame->payload = &frame->data[LWS_PRE];
+    memcpy(frame->payload, head, head_len);
+    notif_json_escape(content, &frame->payload[head_len]);
+    memcpy(&frame->payload[head_len + content_len], "\"}", 2);
+    frame->len = head_len + content_len + 2;
+    return frame;
+}
+
+/**
+ * \brief Evaluate the local filters of a session on a notification, notif_filters_lock is held.
+ *
+ * \return Bits of the matching filters.
+ */
+static uint32_t
+notif_filter_match(struct session_with_mutex *locked_session, struct lyd_node *tree)
+{
+    struct ly_set *set;
+    uint32_t match = 0;
+    int i;
+
+    for (i = 0; tree && (i < NOTIF_FILTER_MAX); ++i) {
+        if (!locked_session->notif_filters[i].xpath) {
+            continue;
+        }
+        set = lyd_find_path(tree, locked_session->notif_filters[i].xpath);
+        if (set && set->number) {
+            match |= (uint32_t)1 << i;
+        }
+        ly_set_free(set);
+    }
+    return match;
+}
+
+/**
+ * \brief Register a local filter of a websocket client, equal filters share an index.
+ *
+ * \param[in] locked_session Session of the client.
+ * \param[in] xpath XPath filter, NULL for an unfiltered client.
+ * \return Index of the filter, NOTIF_FILTER_MAX for no filter, -1 if there are too many filters.
+ */
+static int
+notif_filter_add(struct session_with_mutex *locked_session, const char *xpath)
+{
+    struct notif_filter *filters = locked_session->notif_filters;
+    int i, ret = -1;
+
+    pthread_mutex_lock(&locked_session->notif_filters_lock);
+    if (!xpath) {
+        ++locked_session->notif_unfiltered;
+        ret = NOTIF_FILTER_MAX;
+        goto finalize;
+    }
+    for (i = 0; i < NOTIF_FILTER_MAX; ++i) {
+        if (filters[i].xpath && !strcmp(filters[i].xpath, xpath)) {
+            ++filters[i].refs;
+            ret = i;
+            goto finalize;
+        }
+    }
+    for (i = 0; i < NOTIF_FILTER_MAX; ++i) {
+        if (!filters[i].xpath) {
+            filters[i].xpath = strdup(xpath);
+            if (filters[i].xpath) {
+                filters[i].refs = 1;
+                ret = i;
+            }
+            goto finalize;
+        }
+    }
+
+finalize:
+    pthread_mutex_unlock(&locked_session->notif_filters_lock);
+    return ret;
+}
+
+/**
+ * \brief Unregister a local filter of a websocket client.
+ */
+static void
+notif_filter_remove(struct session_with_mutex *locked_session, int filter)
+{
+    struct notif_filter *filters = locked_session->notif_filters;
+
+    pthread_mutex_lock(&locked_session->notif_filters_lock);
+    if (filter == NOTIF_FILTER_MAX) {
+        --locked_session->notif_unfiltered;
+    } else if (!--filters[filter].refs) {
+        free(filters[filter].xpath);
+        filters[filter].xpath = NULL;
+    }
+    pthread_mutex_unlock(&locked_session->notif_filters_lock);
+}
+
 /**
  * \brief Callback to store incoming notification
- * \param [in] eventtime - time when notification occured
- * \param [in] content - content of notification
+ * \param [in] session - NETCONF session of the notification
+ * \param [in] notif - received notification
  */
 static void
 notification_fileprint(struct nc_session *session, const struct nc_notif *notif)
 {
     time_t eventtime;
     struct session_with_mutex *target_session = NULL;
-    notification_t *ntf = NULL;
-    const char *session_id = NULL;
-    char *content;
-    (void)session;
+    struct notif_frame *frame;
+    uint32_t match;
+    char *content = NULL;
 
     eventtime = nc_datetime2time(notif->datetime);
-    lyd_print_mem(&content, notif->tree, LYD_JSON, 0);
-
-    DEBUG("Accepted notif: %lu %s\n", (unsigned long int) eventtime, content);
 
-    session_id = pthread_getspecific(thread_key);
-    DEBUG("notification: fileprint getspecific (%s)", session_id);
-    if (pthread_rwlock_wrlock(&session_lock) != 0) {
-        ERROR("notifications: Error while locking rwlock");
-        free(content);
-        return;
-    }
-    DEBUG("Get session with mutex from key %s.", session_id);
-    target_session = get_ncsession_from_sid(session_id);
+    target_session = notif_thread_session(session);
     if (target_session == NULL) {
-        ERROR("notifications: no session found last_session_key (%s)", session_id);
-        free(content);
-        goto unlock_glob;
-    }
-    if (pthread_mutex_lock(&target_session->lock) != 0) {
-        ERROR("notifications: Error while locking rwlock");
+        ERROR("notifications: no session found for the notification");
+        return;
     }
 
-    DEBUG("notification: ready to push to notifications queue");
-    if (target_session->notif_count < NOTIFICATION_QUEUE_SIZE) {
-        ++target_session->notif_count;
-        target_session->notifications = realloc(target_session->notifications,
-                                                target_session->notif_count * sizeof *target_session->notifications);
-        if (target_session->notifications) {
-            ntf = target_session->notifications + target_session->notif_count - 1;
-        }
+    if (notif->tree && !strcmp(notif->tree->schema->name, "netconf-config-change")) {
+        /* configuration changed by someone else */
+        session_config_changed(target_session);
     }
-    if (ntf == NULL) {
-        ERROR("notifications: Failed to allocate element ");
-        free(content);
-        goto unlock_all;
+
+    /* the filters cannot change until the notification is queued */
+    pthread_mutex_lock(&target_session->notif_filters_lock);
+    match = notif_filter_match(target_session, notif->tree);
+    if (!target_session->notif_unfiltered && !match) {
+        pthread_mutex_unlock(&target_session->notif_filters_lock);
+        DEBUG("notifications: notification %lu filtered out.", (unsigned long int) eventtime);
+        return;
     }
-    ntf->eventtime = eventtime;
-    ntf->content = content;
 
-    DEBUG("added notif to queue %u (%s)", (unsigned int) ntf->eventtime, "notification");
+    lyd_print_mem(&content, notif->tree, LYD_JSON, 0);
+    DEBUG("Accepted notif: %lu %s\n", (unsigned long int) eventtime, content);
 
-unlock_all:
-    if (pthread_mutex_unlock(&target_session->lock) != 0) {
-        ERROR("notifications: Error while unlocking rwlock");
-    }
-unlock_glob:
-    if (pthread_rwlock_unlock(&session_lock) != 0) {
-        ERROR("notifications: Error while locking rwlock");
+    /* serialized only once, the frame is sent as it is to all the clients */
+    frame = notif_frame_create(eventtime, content ? content : "");
+    free(content);
+    if (frame == NULL) {
+        pthread_mutex_unlock(&target_session->notif_filters_lock);
+        return;
     }
+    frame->match = match;
+
+    notif_ring_push(&target_session->notif_ring, eventtime, frame);
+    pthread_mutex_unlock(&target_session->notif_filters_lock);
+    DEBUG("added notif to queue %u (%s)", (unsigned int) eventtime, "notification");
+    notif_wakeup(&target_session->notif_ring, nc_session_get_id(session));
 }
 
+/**
+ * \brief Create the NETCONF subscription of a session shared by its websocket clients, the session is locked.
+ *
+ * \param[in] stream Stream, NULL for the default one.
+ * \param[in] filter Subtree (starting with '<') or XPath filter, can be NULL.
+ * \return 0 on success, -1 on error.
+ */
 int
-notif_subscribe(struct session_with_mutex *locked_session, const char *session_id, time_t start_time, time_t stop_time)
+notif_subscribe(struct session_with_mutex *locked_session, const char *session_id, time_t start_time, time_t stop_time,
+                const char *stream, const char *filter)
 {
     time_t start = -1;
     time_t stop = -1;
-    char *stream = NULL;
     struct nc_rpc *rpc = NULL;
     struct nc_session *session;
+    (void)session_id;
 
     DEBUG("notif_subscribe");
     if (locked_session == NULL) {
@@ -544,7 +906,6 @@ notif_subscribe(struct session_with_mutex *locked_session, const char *session_i
         return -1;
     }
 
-    pthread_mutex_lock(&locked_session->lock);
     session = locked_session->session;
 
     start = time(NULL) + start_time;
@@ -566,7 +927,7 @@ notif_subscribe(struct session_with_mutex *locked_session, const char *session_i
 
     DEBUG("Prepare to execute subscription.");
     /* create requests */
-    rpc = nc_rpc_subscribe(stream, NULL, (start_time == -1) ? NULL : nc_time2datetime(start, NULL, NULL),
+    rpc = nc_rpc_subscribe(stream, filter, (start_time == -1) ? NULL : nc_time2datetime(start, NULL, NULL),
                            (stop_time == 0) ? NULL : nc_time2datetime(stop, NULL, NULL), NC_PARAMTYPE_CONST);
     if (rpc == NULL) {
         ERROR("notifications: creating an rpc request failed.");
@@ -589,206 +950,912 @@ notif_subscribe(struct session_with_mutex *locked_session, const char *session_i
 
     rpc = NULL; /* just note that rpc is already freed by send_recv_process() */
 
-    DEBUG("notifications: creating libnetconf notification thread (%s).", session_id);
-
-    pthread_mutex_unlock(&locked_session->lock);
+    /* the clients subscribing later share it */
+    free(locked_session->notif_stream);
+    free(locked_session->notif_filter);
+    locked_session->notif_stream = stream ? strdup(stream) : NULL;
+    locked_session->notif_filter = filter ? strdup(filter) : NULL;
 
-    /* store hash identification of netconf session for notifications printing callback */
-    if (pthread_setspecific(thread_key, session_id) != 0) {
-        ERROR("notifications: cannot set thread-specific hash value.");
-    }
+    DEBUG("notifications: creating libnetconf notification thread (%s).", session_id);
 
     DEBUG("Create notification_thread.");
     nc_recv_notif_dispatch(session, notification_fileprint);
     return 0;
 
 operation_failed:
-    pthread_mutex_unlock(&locked_session->lock);
     return -1;
 }
 
-static int
-callback_notification(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+/**
+ * \brief Find the hub of a session or create it, only in the websocket service.
+ *
+ * \param[in] ls Session, a new hub takes its reference.
+ * \param[in] sid NETCONF session ID.
+ */
+static struct notif_hub *
+notif_hub_get(struct session_with_mutex *ls, unsigned int sid)
 {
-    int n = 0, m = 0, i;
-    unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + 40960 + LWS_SEND_BUFFER_POST_PADDING];
-    unsigned char *p = &buf[LWS_SEND_BUFFER_PRE_PADDING];
-    struct per_session_data__notif_client *pss = (struct per_session_data__notif_client *)user;
+    struct notif_hub *hub;
 
-    debug_print_clb(__func__, reason);
+    for (hub = hubs; hub && (hub->session != ls); hub = hub->next);
+    if (hub) {
+        ++hub->clients;
+        return hub;
+    }
 
-    switch (reason) {
-    case LWS_CALLBACK_ESTABLISHED:
-        DEBUG("notification client connected.");
-        break;
+    hub = calloc(1, sizeof *hub);
+    if (hub) {
+        hub->slots = calloc(NOTIFICATION_QUEUE_SIZE, sizeof *hub->slots);
+    }
+    if (!hub || !hub->slots) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        free(hub);
+        return NULL;
+    }
+    session_ref(ls);
+    hub->session = ls;
+    hub->sid = sid;
+    hub->size = NOTIFICATION_QUEUE_SIZE;
+    hub->clients = 1;
+    hub->next = hubs;
+    hubs = hub;
+    return hub;
+}
 
-    case LWS_CALLBACK_SERVER_WRITEABLE:
-        if (pss->session_id == NULL) {
-            return 0;
-        }
-        //DEBUG("Callback server writeable.");
-        //DEBUG("lock session lock.");
-        if (pthread_rwlock_wrlock(&session_lock) != 0) {
-            DEBUG("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
-            return -1;
-        }
-        //DEBUG("get session_with_mutex for %s.", pss->session_id);
-        struct session_with_mutex *ls = get_ncsession_from_sid(pss->session_id);
-        if (ls == NULL) {
-            DEBUG("notification: session not found");
-            if (pthread_rwlock_unlock (&session_lock) != 0) {
-                DEBUG("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
-                return -1;
-            }
-            return -1;
-        }
-        pthread_mutex_lock(&ls->lock);
-        if (pthread_rwlock_unlock(&session_lock) != 0) {
-            DEBUG("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
-        }
+/**
+ * \brief Release a hub of a client, the last client frees it.
+ */
+static void
+notif_hub_put(struct notif_hub *hub)
+{
+    struct notif_hub **iter;
+    unsigned long seq;
 
-        //DEBUG("check for closed session.");
-        if (ls->closed == 1) {
-            DEBUG("unlock session key.");
-            if (pthread_rwlock_unlock (&session_lock) != 0) {
-                DEBUG("Error while unlocking unlock: %d (%s)", errno, strerror(errno));
-                return -1;
-            }
-            return -1;
+    if (--hub->clients) {
+        return;
+    }
+
+    for (iter = &hubs; *iter; iter = &(*iter)->next) {
+        if (*iter == hub) {
+            *iter = hub->next;
+            break;
         }
-        //DEBUG("lock private lock.");
-        notification_t *notif = NULL;
-
-        if (ls->notif_count) {
-            DEBUG("notification: POP notifications for session");
-            for (i = ls->notif_count; i; --i) {
-                notif = ls->notifications + i - 1;
-
-                n = 0;
-                pthread_mutex_lock(&json_lock);
-                json_object *notif_json = json_object_new_object();
-                json_object_object_add(notif_json, "eventtime", json_object_new_int64(notif->eventtime));
-                json_object_object_add(notif_json, "content", json_object_new_string(notif->content));
-                pthread_mutex_unlock(&json_lock);
-
-                const char *msgtext = json_object_to_json_string(notif_json);
-
-                //n = sprintf((char *)p, "{\"eventtime\": \"%s\", \"content\": \"notification\"}", t);
-                n = sprintf((char *)p, "%s", msgtext);
-                DEBUG("ws send %dB in %lu", n, sizeof(buf));
-                m = lws_write(wsi, p, n, LWS_WRITE_TEXT);
-                if (lws_send_pipe_choked(wsi)) {
-                    lws_callback_on_writable(wsi);
-                    break;
-                }
+    }
+    for (seq = (hub->head > hub->size) ? hub->head - hub->size : 0; seq < hub->head; ++seq) {
+        notif_frame_put(hub->slots[seq % hub->size].frame);
+    }
+    free(hub->slots);
+    session_unref(hub->session);
+    free(hub);
+}
 
-                pthread_mutex_lock(&json_lock);
-                json_object_put(notif_json);
-                pthread_mutex_unlock(&json_lock);
-                free(notif->content);
-            }
-            ls->notif_count = 0;
-            free(ls->notifications);
-            ls->notifications = NULL;
+#if NOTIFICATION_BENCH
+/**
+ * \brief Top the hub of the synthetic session up to a full hub waiting for its slowest client and keep
+ * the client being served writeable, so it gets the notifications as fast as it takes them.
+ */
+static void
+notif_bench_fill(struct notif_hub *hub, struct per_session_data__notif_client *pss)
+{
+    struct per_session_data__notif_client *iter;
+    notification_t *slot;
+    unsigned long oldest = hub->head;
+    char *content;
 
-            DEBUG("notification: POP notifications done");
+    if (!bench_frame) {
+        content = malloc(NOTIFICATION_BENCH_SIZE + 1);
+        if (!content) {
+            ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+            return;
         }
-
-        //DEBUG("unlock private lock");
-        if (pthread_mutex_unlock(&ls->lock) != 0) {
-            DEBUG("notification: cannot unlock session");
+        memset(content, 'x', NOTIFICATION_BENCH_SIZE);
+        content[NOTIFICATION_BENCH_SIZE] = '\0';
+        bench_frame = notif_frame_create(time(NULL), content);
+        free(content);
+        if (!bench_frame) {
+            return;
         }
-        //DEBUG("unlock session lock");
-
-        if (m < n) {
-            DEBUG("ERROR %d writing to di socket.", n);
+    }
 
-            return -1;
+    for (iter = subscribers; iter; iter = iter->next) {
+        if ((iter->hub == hub) && (hub->head - iter->cursor > hub->head - oldest)) {
+            oldest = iter->cursor;
         }
-        break;
-
-    case LWS_CALLBACK_RECEIVE:
-        DEBUG("Callback receive.");
-        DEBUG("received: (%s)", (char *)in);
-        if (pss->session_id == NULL) {
-            char *sid_end;
-            int start = -1;
-            time_t stop = time(NULL) + 30;
+    }
+    while (hub->head - oldest < hub->size) {
+        slot = &hub->slots[hub->head % hub->size];
+        if (hub->head >= hub->size) {
+            notif_frame_put(slot->frame);
+        }
+        slot->eventtime = time(NULL);
+        slot->frame = notif_frame_get(bench_frame);
+        ++hub->head;
+    }
+    if (pss) {
+        lws_callback_on_writable(pss->wsi);
+    }
+}
+#endif
 
-            sid_end = strchr(in, ' ');
-            pss->session_id = strndup(in, sid_end - (char *)in);
+/**
+ * \brief Move the notifications from the queue of the session into its hub, overwriting the oldest ones.
+ * The queue is lock-free, the websocket service is its only consumer.
+ *
+ * \param[in] hub Hub of the session.
+ * \param[in] pss Client being served, the other clients of the hub are asked to write the new notifications.
+ */
+static void
+notif_hub_fill(struct notif_hub *hub, struct per_session_data__notif_client *pss)
+{
+    struct notif_ring *ring = &hub->session->notif_ring;
+    struct per_session_data__notif_client *iter;
+    notification_t notif, *slot;
+    unsigned long dropped, head = hub->head;
+
+#if NOTIFICATION_BENCH
+    if (hub->session == &bench_session) {
+        notif_bench_fill(hub, pss);
+        return;
+    }
+#endif
 
-            ++sid_end;
-            sscanf(sid_end, "%d %d", (int *) &start, (int *) &stop);
-            DEBUG("notification: SID (%s) from (%s) (%i,%i)", pss->session_id, (char *) in, (int) start, (int) stop);
+    /* notifications pushed from now on wake the service up again */
+    __atomic_store_n(&ring->signalled, 0, __ATOMIC_RELEASE);
 
-            DEBUG("lock session lock");
-            if (pthread_rwlock_rdlock (&session_lock) != 0) {
-                DEBUG("Error while locking rwlock: %d (%s)", errno, strerror(errno));
-                return -1;
-            }
-            DEBUG("get session with ID (%s)", pss->session_id);
-            struct session_with_mutex *ls = get_ncsession_from_sid(pss->session_id);
-            if (ls == NULL) {
-                DEBUG("notification: session_id not found (%s)", pss->session_id);
-                DEBUG("unlock session lock");
-                if (pthread_rwlock_unlock (&session_lock) != 0) {
-                    DEBUG("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
-                }
-                DEBUG("Close notification client");
-                return -1;
-            }
-            DEBUG("lock private lock");
-            pthread_mutex_lock(&ls->lock);
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != hub->ring_dropped) {
+        /* the queue overflowed before the service got to it */
+        hub->lost += dropped - hub->ring_dropped;
+        hub->ring_dropped = dropped;
+    }
 
-            DEBUG("unlock session lock");
-            if (pthread_rwlock_unlock (&session_lock) != 0) {
-                DEBUG("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
-            }
+    slot = &hub->slots[hub->head % hub->size];
+    while (!notif_ring_pop(ring, &notif)) {
+        if (hub->head >= hub->size) {
+            notif_frame_put(slot->frame);
+        }
+        *slot = notif;
+        slot = &hub->slots[++hub->head % hub->size];
+    }
 
-            DEBUG("Found session to subscribe notif.");
-            if (ls->closed == 1) {
-                DEBUG("session already closed - handle no notification");
-                DEBUG("unlock private lock");
-                pthread_mutex_unlock(&ls->lock);
-                DEBUG("Close notification client");
-                return -1;
+    if (hub->head != head) {
+        for (iter = subscribers; iter; iter = iter->next) {
+            if ((iter != pss) && (iter->hub == hub)) {
+                lws_callback_on_writable(iter->wsi);
             }
-            if (nc_session_ntf_thread_running(ls->session)) {
-                DEBUG("notification: already subscribed");
-                DEBUG("unlock private lock");
-                pthread_mutex_unlock(&ls->lock);
-                /* do not close client, only do not subscribe again */
-                return 0;
-            }
-            DEBUG("notification: prepare to subscribe stream");
-            DEBUG("unlock session lock");
-            pthread_mutex_unlock(&ls->lock);
-
-            /* notif_subscribe locks on its own */
-            return notif_subscribe(ls, pss->session_id, (time_t) start, (time_t) stop);
         }
-        if (len < 6)
-            break;
-        break;
-    /*
-     * this just demonstrates how to use the protocol filter. If you won't
-     * study and reject connections based on header content, you don't need
-     * to handle this callback
-     */
+    }
+}
+
+static void
+notif_client_stats(struct per_session_data__notif_client *pss, const char *event)
+{
+    /* slow-consumer metrics and compression ratio, logged in release builds too */
+    INFO("notification client (%s) %s: sent %lu in %lu frames (%llu B), choked %lu, max backlog %lu, missed %lu",
+          pss->session_id, event, pss->sent, pss->frames, pss->bytes, pss->choked, pss->max_backlog, pss->missed);
+    if (pss->deflate_in) {
+        INFO("notification client (%s) %s: permessage-deflate %llu B -> %llu B (ratio %.2f)", pss->session_id, event,
+              pss->deflate_in, pss->deflate_out, (double)pss->deflate_out / pss->deflate_in);
+    }
+}
+
+/**
+ * \brief Monotonic time in ms.
+ */
+static unsigned long long
+notif_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Check whether a notification passes the filter of a client.
+ */
+static int
+notif_client_match(struct per_session_data__notif_client *pss, struct notif_frame *frame)
+{
+    return (pss->filter == NOTIF_FILTER_MAX) || (frame->match & ((uint32_t)1 << pss->filter));
+}
+
+/**
+ * \brief Check whether a notification is sent in fragments.
+ */
+static int
+notif_frame_fragmented(struct notif_frame *frame)
+{
+    return (frame->len > NOTIFICATION_FRAGMENT_SIZE) || (frame->len + 2 > NOTIFICATION_BATCH_SIZE);
+}
+
+/**
+ * \brief Continue sending a large notification in fragments of at most NOTIFICATION_FRAGMENT_SIZE bytes
+ * copied from the shared frame, so a partially sent one buffered by libwebsockets stays small. A batch
+ * client gets it alone in a JSON array.
+ *
+ * \return 0 on success (pss->stream is NULL once the whole notification is sent), -1 to close the connection.
+ */
+static int
+notif_client_stream(struct lws *wsi, struct per_session_data__notif_client *pss)
+{
+    struct notif_frame *frame = pss->stream;
+    size_t total, off, chunk, i, n;
+    unsigned char *p;
+    int flags;
+
+    if (!pss->frag_buf && !(pss->frag_buf = malloc(LWS_PRE + NOTIFICATION_FRAGMENT_SIZE))) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return -1;
+    }
+    p = &pss->frag_buf[LWS_PRE];
+
+    /* the message is "[<notification>]" for a batch client */
+    total = frame->len + (pss->batch ? 2 : 0);
+    while (pss->stream_off < total) {
+        if (lws_send_pipe_choked(wsi)) {
+            /* continue when writeable again */
+            ++pss->choked;
+            lws_callback_on_writable(wsi);
+            return 0;
+        }
+
+        off = pss->stream_off;
+        chunk = (total - off > NOTIFICATION_FRAGMENT_SIZE) ? NOTIFICATION_FRAGMENT_SIZE : total - off;
+        for (i = 0; i < chunk; i += n) {
+            if (pss->batch && ((off + i == 0) || (off + i == total - 1))) {
+                p[i] = (off + i) ? ']' : '[';
+                n = 1;
+                continue;
+            }
+            n = frame->len - (off + i - (pss->batch ? 1 : 0));
+            if (n > chunk - i) {
+                n = chunk - i;
+            }
+            memcpy(&p[i], &frame->payload[off + i - (pss->batch ? 1 : 0)], n);
+        }
+
+        flags = off ? LWS_WRITE_CONTINUATION : LWS_WRITE_TEXT;
+        if (off + chunk < total) {
+            flags |= LWS_WRITE_NO_FIN;
+        }
+        if (!off) {
+            /* the whole message is either compressed or not */
+            pss->deflate = (total >= NOTIFICATION_DEFLATE_THRESHOLD);
+        }
+        if (lws_write(wsi, p, chunk, (enum lws_write_protocol)flags) < (signed)chunk) {
+            DEBUG("ERROR %lu writing to di socket.", (unsigned long)chunk);
+            return -1;
+        }
+        pss->stream_off += chunk;
+    }
+
+    ++pss->sent;
+    ++pss->frames;
+    pss->bytes += total;
+    notif_frame_put(frame);
+    pss->stream = NULL;
+    pss->stream_off = 0;
+    return 0;
+}
+
+/**
+ * \brief Send the notifications after the client cursor in JSON array frames of at most NOTIFICATION_BATCH_SIZE
+ * bytes. The first waiting notification is delayed up to NOTIFICATION_BATCH_DELAY ms unless a full frame waits,
+ * the service loop asks for the writeable callback when the delay expires.
+ *
+ * \return 0 on success, -1 to close the connection.
+ */
+static int
+notif_client_write_batch(struct lws *wsi, struct per_session_data__notif_client *pss)
+{
+    struct notif_hub *hub = pss->hub;
+    struct notif_frame *frame;
+    unsigned long long now;
+    unsigned long seq, count = 0;
+    unsigned char *p;
+    size_t len;
+    int m;
+
+    pss->batch_armed = 0;
+    while ((pss->cursor != hub->head) && !notif_client_match(pss, hub->slots[pss->cursor % hub->size].frame)) {
+        /* filtered out for this client */
+        ++pss->cursor;
+    }
+    if (pss->cursor == hub->head) {
+        pss->batch_due = 0;
+        return 0;
+    }
+
+    now = notif_time_ms();
+    if (!pss->batch_due) {
+        pss->batch_due = now + NOTIFICATION_BATCH_DELAY;
+    }
+    if (now < pss->batch_due) {
+        /* wait for more unless they fill a frame */
+        for (seq = pss->cursor, len = 2; (seq != hub->head) && (len < NOTIFICATION_BATCH_SIZE); ++seq) {
+            frame = hub->slots[seq % hub->size].frame;
+            if (notif_client_match(pss, frame)) {
+                len += frame->len + 1;
+            }
+        }
+        if (len < NOTIFICATION_BATCH_SIZE) {
+            return 0;
+        }
+    }
+
+    if (lws_send_pipe_choked(wsi)) {
+        /* continue when writeable again */
+        ++pss->choked;
+        pss->batch_armed = 1;
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+
+    frame = hub->slots[pss->cursor % hub->size].frame;
+    if (notif_frame_fragmented(frame)) {
+        /* sent alone, the rest after it */
+        pss->stream = notif_frame_get(frame);
+        ++pss->cursor;
+        if (notif_client_stream(wsi, pss)) {
+            return -1;
+        }
+        pss->batch_due = 0;
+        if (!pss->stream && (pss->cursor != hub->head)) {
+            pss->batch_due = now;
+            pss->batch_armed = 1;
+            lws_callback_on_writable(wsi);
+        }
+        return 0;
+    }
+
+    if (!pss->batch_buf && !(pss->batch_buf = malloc(LWS_PRE + NOTIFICATION_BATCH_SIZE))) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        return -1;
+    }
+    p = &pss->batch_buf[LWS_PRE];
+
+    len = 0;
+    for (; pss->cursor != hub->head; ++pss->cursor) {
+        frame = hub->slots[pss->cursor % hub->size].frame;
+        if (!notif_client_match(pss, frame)) {
+            continue;
+        }
+        if (notif_frame_fragmented(frame) || (len + frame->len + 2 > NOTIFICATION_BATCH_SIZE)) {
+            /* full */
+            break;
+        }
+        p[len++] = count ? ',' : '[';
+        memcpy(&p[len], frame->payload, frame->len);
+        len += frame->len;
+        ++count;
+    }
+    p[len++] = ']';
+
+    /* a partially sent frame is buffered by libwebsockets */
+    pss->deflate = (len >= NOTIFICATION_DEFLATE_THRESHOLD);
+    m = lws_write(wsi, p, len, LWS_WRITE_TEXT);
+    if (m < (signed)len) {
+        DEBUG("ERROR %lu writing to di socket.", (unsigned long)len);
+        return -1;
+    }
+    pss->sent += count;
+    pss->bytes += len;
+    ++pss->frames;
+
+    pss->batch_due = 0;
+    if (pss->cursor != hub->head) {
+        /* the rest right away */
+        pss->batch_due = now;
+        pss->batch_armed = 1;
+        lws_callback_on_writable(wsi);
+    }
+    return 0;
+}
+
+/**
+ * \brief Ask for the writeable callback of the clients with an expired batch delay.
+ *
+ * \return Timeout (in ms) of the service poll until the next batch delay expires.
+ */
+static int
+notif_batch_timeout(int timeout)
+{
+    struct per_session_data__notif_client *pss;
+    unsigned long long now = 0;
+
+    for (pss = subscribers; pss; pss = pss->next) {
+        if (!pss->batch_due || pss->batch_armed) {
+            continue;
+        }
+        if (!now) {
+            now = notif_time_ms();
+        }
+        if (pss->batch_due <= now) {
+            pss->batch_armed = 1;
+            lws_callback_on_writable(pss->wsi);
+        } else if ((timeout < 0) || (pss->batch_due - now < (unsigned)timeout)) {
+            timeout = pss->batch_due - now;
+        }
+    }
+    return timeout;
+}
+
+/**
+ * \brief Send the notifications of the session hub after the client cursor, oldest first.
+ *
+ * The notifications stay in the hub for the other clients, a client too slow to keep up misses
+ * those overwritten before it got to them.
+ *
+ * \return 0 on success, -1 to close the connection.
+ */
+static int
+notif_client_write(struct lws *wsi, struct per_session_data__notif_client *pss)
+{
+    struct notif_hub *hub = pss->hub;
+    struct notif_frame *frame;
+    unsigned long missed, lag;
+    int n, m;
+
+    if (pss->stream) {
+        /* nothing else can be sent until the fragmented message is complete */
+        if (notif_client_stream(wsi, pss)) {
+            return -1;
+        }
+        if (pss->stream) {
+            return 0;
+        }
+    }
+
+    /* the session queue overflowed, the same for all the clients of the session */
+    missed = hub->lost - pss->lost_seen;
+    pss->lost_seen = hub->lost;
+    if (missed) {
+        ERROR("notifications: websocket client (%s) missed %lu notifications, the session queue was full.",
+              pss->session_id, missed);
+    }
+    if (hub->head - pss->cursor > hub->size) {
+        /* the client is too slow */
+        lag = hub->head - hub->size - pss->cursor;
+        pss->cursor = hub->head - hub->size;
+        ERROR("notifications: websocket client (%s) missed %lu notifications, it is too slow.", pss->session_id, lag);
+        pss->missed += missed + lag;
+#if NOTIFICATION_SLOW_CONSUMER_DISCONNECT
+        notif_client_stats(pss, "disconnected");
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, (unsigned char *)"notifications dropped", 21);
+        return -1;
+#else
+        missed += lag;
+#endif
+    } else {
+        pss->missed += missed;
+    }
+    if (missed) {
+        unsigned char buf[LWS_PRE + 32];
+        unsigned char *p = &buf[LWS_PRE];
+
+        /* always sent, a partially sent frame is buffered by libwebsockets; batch clients get only arrays */
+        n = sprintf((char *)p, pss->batch ? "[{\"dropped\":%lu}]" : "{\"dropped\":%lu}", missed);
+        pss->deflate = 0;
+        if (lws_write(wsi, p, n, LWS_WRITE_TEXT) < n) {
+            return -1;
+        }
+    }
+
+    if (hub->head - pss->cursor > pss->max_backlog) {
+        pss->max_backlog = hub->head - pss->cursor;
+    }
+    if (pss->batch) {
+        return notif_client_write_batch(wsi, pss);
+    }
+
+    while (pss->cursor != hub->head) {
+        frame = hub->slots[pss->cursor % hub->size].frame;
+        if (!notif_client_match(pss, frame)) {
+            /* filtered out for this client */
+            ++pss->cursor;
+            continue;
+        }
+        if (lws_send_pipe_choked(wsi)) {
+            /* continue when writeable again */
+            ++pss->choked;
+            lws_callback_on_writable(wsi);
+            break;
+        }
+
+        if (notif_frame_fragmented(frame)) {
+            pss->stream = notif_frame_get(frame);
+            ++pss->cursor;
+            if (notif_client_stream(wsi, pss)) {
+                return -1;
+            }
+            if (pss->stream) {
+                /* choked */
+                break;
+            }
+            continue;
+        }
+
+        /* the prebuilt frame has the space for the websocket header, a partially sent one is buffered by libwebsockets */
+        n = frame->len;
+        pss->deflate = (n >= NOTIFICATION_DEFLATE_THRESHOLD);
+        m = lws_write(wsi, frame->payload, n, LWS_WRITE_TEXT);
+        ++pss->cursor;
+        if (m < n) {
+            DEBUG("ERROR %d writing to di socket.", n);
+            return -1;
+        }
+        ++pss->sent;
+        ++pss->frames;
+        pss->bytes += n;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Release a subscription job with whatever it still holds.
+ */
+static void
+notif_sub_job_free(struct notif_sub_job *job)
+{
+    if (job->ls) {
+        if (job->filter != -1) {
+            notif_filter_remove(job->ls, job->filter);
+        }
+        session_unref(job->ls);
+    }
+    free(job->session_id);
+    free(job->params);
+    free(job);
+}
+
+/**
+ * \brief Look up the session of a subscription and share or create its NETCONF subscription,
+ * only in the subscription worker thread.
+ *
+ * Sets job->ret to -1 (and job->refusal for a refused client) on error.
+ */
+static void
+notif_sub_job_run(struct notif_sub_job *job)
+{
+    char *stream, *filter;
+    const char *upstream = NULL, *local;
+    int start = -1, pos = 0, running;
+    time_t stop = time(NULL) + 30;
+    struct session_with_mutex *ls;
+
+    job->ret = -1;
+    sscanf(job->params, "%d %d%n", (int *) &start, (int *) &stop, &pos);
+    DEBUG("notification: SID (%s) (%i,%i)", job->session_id, (int) start, (int) stop);
+
+    /* optional stream ("-" for the default one) and filter (the rest of the message) */
+    stream = job->params + pos;
+    stream += strspn(stream, " ");
+    filter = stream + strcspn(stream, " ");
+    if (*filter) {
+        *filter++ = '\0';
+        filter += strspn(filter, " ");
+    }
+    if (!*stream || !strcmp(stream, "-")) {
+        stream = NULL;
+    }
+    if (!*filter) {
+        filter = NULL;
+    }
+
+#if NOTIFICATION_BENCH
+    if (!strcmp(job->session_id, "0")) {
+        /* synthetic session, all its notifications are unfiltered */
+        session_ref(&bench_session);
+        job->ls = &bench_session;
+        job->filter = notif_filter_add(&bench_session, NULL);
+        job->created = 1;
+        job->ret = 0;
+        return;
+    }
+#endif
+
+    DEBUG("lock session lock");
+    if (pthread_rwlock_rdlock (&session_lock) != 0) {
+        DEBUG("Error while locking rwlock: %d (%s)", errno, strerror(errno));
+        return;
+    }
+    DEBUG("get session with ID (%s)", job->session_id);
+    ls = get_ncsession_from_sid(job->session_id);
+    if (ls == NULL) {
+        DEBUG("notification: session_id not found (%s)", job->session_id);
+        DEBUG("unlock session lock");
+        if (pthread_rwlock_unlock (&session_lock) != 0) {
+            DEBUG("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
+        }
+        return;
+    }
+    /* kept for the hub of the client */
+    session_ref(ls);
+    job->ls = ls;
+    DEBUG("lock private lock");
+    pthread_mutex_lock(&ls->lock);
+
+    DEBUG("unlock session lock");
+    if (pthread_rwlock_unlock (&session_lock) != 0) {
+        DEBUG("Error while unlocking rwlock: %d (%s)", errno, strerror(errno));
+    }
+
+    DEBUG("Found session to subscribe notif.");
+    if (ls->closed == 1) {
+        DEBUG("session already closed - handle no notification");
+        goto finalize;
+    }
+    job->sid = nc_session_get_id(ls->session);
+
+    /*
+     * the subscription is shared by all the clients of the session, the filter of the client creating it
+     * is applied by the server if it can be, others are evaluated on the received notifications; a subscription
+     * filtered by the server lasts as long as the session, so it is shared only by clients with the same filter
+     */
+    running = nc_session_ntf_thread_running(ls->session);
+    if (running) {
+        if (strcmp(stream ? stream : "NETCONF", ls->notif_stream ? ls->notif_stream : "NETCONF")) {
+            job->refusal = "different stream subscribed";
+        } else if (ls->notif_filter && (!filter || strcmp(filter, ls->notif_filter))) {
+            job->refusal = "different filter subscribed";
+        }
+        local = ls->notif_filter ? NULL : filter;
+    } else if (filter && ((filter[0] == '<')
+            || nc_session_cpblt(ls->session, "urn:ietf:params:netconf:capability:xpath:1.0"))) {
+        upstream = filter;
+        local = NULL;
+    } else {
+        local = filter;
+    }
+    if (!job->refusal && local && (local[0] == '<')) {
+        job->refusal = "subtree filter not applicable";
+    }
+    if (!job->refusal && ((job->filter = notif_filter_add(ls, local)) == -1)) {
+        job->refusal = "too many filters";
+    }
+    if (job->refusal) {
+        ERROR("notifications: websocket client (%s) refused, %s.", job->session_id, job->refusal);
+        goto finalize;
+    }
+
+    /* drained by the websocket service once the client is attached */
+    if (!ls->notif_ring.slots && notif_ring_init(&ls->notif_ring, NOTIFICATION_QUEUE_SIZE)) {
+        goto finalize;
+    }
+
+    if (running) {
+        DEBUG("notification: already subscribed");
+        /* do not close client, only share the existing subscription */
+        job->ret = 0;
+        goto finalize;
+    }
+    DEBUG("notification: prepare to subscribe stream");
+    /* the session stays locked, so other clients wait for the subscription instead of creating another one */
+    if (!notif_subscribe(ls, job->session_id, (time_t) start, (time_t) stop, stream, upstream)) {
+        job->created = 1;
+        job->ret = 0;
+    }
+
+finalize:
+    DEBUG("unlock private lock");
+    pthread_mutex_unlock(&ls->lock);
+}
+
+/**
+ * \brief Subscription worker thread, the RPC may take long and must not block the websocket service.
+ */
+static void *
+notif_sub_thread(void *arg)
+{
+    struct notif_sub_job *job = (struct notif_sub_job *)arg;
+    uint64_t one = 1;
+
+    notif_sub_job_run(job);
+
+    /* hand it over to the websocket service */
+    pthread_mutex_lock(&wake_lock);
+    if (wake_fd != -1) {
+        job->next = sub_done;
+        sub_done = job;
+        job = NULL;
+        if (write(wake_fd, &one, sizeof one) != sizeof one) {
+            ERROR("notifications: cannot wake up the websocket service (%s).", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&wake_lock);
+
+    if (job) {
+        /* the websocket service is stopped */
+        notif_sub_job_free(job);
+    }
+    return NULL;
+}
+
+/**
+ * \brief Attach a websocket client to the hub of its session once its subscription is done,
+ * only in the websocket service.
+ */
+static void
+notif_client_attach(struct notif_sub_job *job)
+{
+    struct per_session_data__notif_client *pss = job->pss;
+
+    if (pss == NULL) {
+        /* the client is gone */
+        notif_sub_job_free(job);
+        return;
+    }
+    pss->job = NULL;
+
+    if (!job->ret) {
+        pss->hub = notif_hub_get(job->ls, job->sid);
+    }
+    if (!pss->hub) {
+        /* closed when writeable */
+        pss->refused = 1;
+        pss->refusal = job->refusal;
+        lws_callback_on_writable(pss->wsi);
+        notif_sub_job_free(job);
+        return;
+    }
+    pss->filter = job->filter;
+    job->filter = -1;
+    pss->next = subscribers;
+    subscribers = pss;
+
+    if (job->created) {
+        /* all the notifications of the new subscription, even if a client sharing it was attached first */
+        pss->cursor = (pss->hub->head > pss->hub->size) ? pss->hub->head - pss->hub->size : 0;
+    } else {
+        /* the client gets the notifications received from now on */
+        notif_hub_fill(pss->hub, pss);
+        pss->cursor = pss->hub->head;
+    }
+    pss->lost_seen = pss->hub->lost;
+    lws_callback_on_writable(pss->wsi);
+    notif_sub_job_free(job);
+}
+
+/**
+ * \brief Subscribe a websocket client to the notifications of a session, the subscription is created
+ * by a worker thread and the client is attached by notif_client_attach().
+ *
+ * \param[in] msg Subscribe message "<session-id> <start> <stop> [<stream>|- [<filter>]]".
+ * \return 0 on success, -1 to close the connection.
+ */
+static int
+notif_client_subscribe(struct lws *wsi, struct per_session_data__notif_client *pss, char *msg)
+{
+    struct notif_sub_job *job;
+    pthread_t tid;
+    char *sid_end;
+
+    sid_end = strchr(msg, ' ');
+    if (sid_end == NULL) {
+        return -1;
+    }
+
+    job = calloc(1, sizeof *job);
+    if (job) {
+        job->session_id = strndup(msg, sid_end - msg);
+        job->params = strdup(sid_end + 1);
+        pss->session_id = strndup(msg, sid_end - msg);
+    }
+    if (!job || !job->session_id || !job->params || !pss->session_id) {
+        ERROR("Memory allocation failed (%s:%d).", __FILE__, __LINE__);
+        if (job) {
+            notif_sub_job_free(job);
+        }
+        return -1;
+    }
+    job->pss = pss;
+    job->filter = -1;
+    /* linked into the subscribers once attached, CLOSED unlinks the client if session_id is set */
+    pss->wsi = wsi;
+    pss->job = job;
+
+    if (pthread_create(&tid, NULL, notif_sub_thread, job) != 0) {
+        ERROR("notifications: cannot create the subscription thread.");
+        pss->job = NULL;
+        notif_sub_job_free(job);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+static int
+callback_notification(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+{
+    int n = 0;
+    char *msg;
+    struct per_session_data__notif_client *pss = (struct per_session_data__notif_client *)user;
+
+    debug_print_clb(__func__, reason);
+
+    switch (reason) {
+    case LWS_CALLBACK_ESTABLISHED:
+        DEBUG("notification client connected.");
+        pss->filter = -1;
+        pss->batch = !strcmp(lws_get_protocol(wsi)->name, "notification-batch-protocol");
+        break;
+
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+        if (pss->refused) {
+            if (pss->refusal) {
+                lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, (unsigned char *)pss->refusal,
+                                 strlen(pss->refusal));
+            }
+            return -1;
+        }
+        if (pss->hub == NULL) {
+            return 0;
+        }
+        /* never blocks, the hub keeps the session allocated and closing it wakes the service up */
+        if (__atomic_load_n(&pss->hub->session->closed, __ATOMIC_ACQUIRE)) {
+            DEBUG("notification: session closed");
+            return -1;
+        }
+        notif_hub_fill(pss->hub, pss);
+        return notif_client_write(wsi, pss);
+
+    case LWS_CALLBACK_RECEIVE:
+        DEBUG("Callback receive.");
+        DEBUG("received: (%s)", (char *)in);
+        if (pss->session_id == NULL) {
+            msg = strndup(in, len);
+            if (msg == NULL) {
+                return -1;
+            }
+            n = notif_client_subscribe(wsi, pss, msg);
+            free(msg);
+            return n;
+        }
+        if (len < 6)
+            break;
+        break;
+    /*
+     * this just demonstrates how to use the protocol filter. If you won't
+     * study and reject connections based on header content, you don't need
+     * to handle this callback
+     */
 
     case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
         //dump_handshake_info(wsi);
         /* you could return non-zero here and kill the connection */
         break;
-    //gives segfault :-(
-    //case LWS_CALLBACK_CLOSED:
-    //  if (pss->session_key != NULL) {
-    //      free(pss->session_key);
-    //  }
-    //  if (pss != NULL) {
-    //      free(pss);
-    //  }
+    case LWS_CALLBACK_CLOSED:
+        /* pss itself is freed by libwebsockets */
+        if (pss->session_id) {
+            notif_client_stats(pss, "closed");
+            notif_subscriber_remove(pss);
+        }
+        if (pss->job) {
+            /* the subscription thread is still running, the job is freed once it is done */
+            pss->job->pss = NULL;
+            pss->job = NULL;
+        }
+        if (pss->filter != -1) {
+            /* set only with the hub */
+            notif_filter_remove(pss->hub->session, pss->filter);
+            pss->filter = -1;
+        }
+        if (pss->hub) {
+            notif_hub_put(pss->hub);
+            pss->hub = NULL;
+        }
+        free(pss->batch_buf);
+        pss->batch_buf = NULL;
+        notif_frame_put(pss->stream);
+        pss->stream = NULL;
+        free(pss->frag_buf);
+        pss->frag_buf = NULL;
+        free(pss->session_id);
+        pss->session_id = NULL;
+        break;
+
 
     default:
         break;
@@ -797,6 +1864,56 @@ callback_notification(struct lws *wsi, enum lws_callback_reasons reason, void *u
     return 0;
 }
 
+#if NOTIFICATION_DEFLATE
+/**
+ * \brief permessage-deflate of libwebsockets, notification messages shorter than NOTIFICATION_DEFLATE_THRESHOLD
+ * are not compressed. The extension sees neither their payload nor their frames, so it sets the RSV1 bit only
+ * for the messages it compressed.
+ */
+static int
+notif_ext_deflate(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+                  enum lws_extension_callback_reasons reason, void *user, void *in, size_t len)
+{
+    struct per_session_data__notif_client *pss = NULL;
+    struct lws_tokens *eff_buf = (struct lws_tokens *)in;
+    int n;
+
+    if (((reason == LWS_EXT_CB_PAYLOAD_TX) || (reason == LWS_EXT_CB_PACKET_TX_PRESEND))
+            && (lws_get_protocol(wsi)->callback == callback_notification)) {
+        pss = (struct per_session_data__notif_client *)lws_wsi_user(wsi);
+    }
+    if (pss && (reason == LWS_EXT_CB_PAYLOAD_TX)) {
+        pss->deflate_in += eff_buf->token_len;
+        /* remembered for the frame of this payload */
+        pss->deflate_bypass = !pss->deflate;
+        if (pss->deflate_bypass) {
+            pss->deflate_out += eff_buf->token_len;
+            return 0;
+        }
+    } else if (pss && pss->deflate_bypass) {
+        /* LWS_EXT_CB_PACKET_TX_PRESEND of an uncompressed frame, RSV1 stays clear */
+        return 0;
+    }
+
+    n = lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+    if (pss && (reason == LWS_EXT_CB_PAYLOAD_TX) && (n >= 0)) {
+        pss->deflate_out += eff_buf->token_len;
+    }
+    return n;
+}
+
+/* the window and memory level are part of the negotiation offer, so they never override the negotiated values */
+static const struct lws_extension extensions[] = {
+    {
+        "permessage-deflate",
+        notif_ext_deflate,
+        "permessage-deflate; client_max_window_bits; server_max_window_bits="
+        STRINGIFY(NOTIFICATION_DEFLATE_WINDOW_BITS) "; mem_level=" STRINGIFY(NOTIFICATION_DEFLATE_MEM_LEVEL)
+    },
+    { NULL, NULL, NULL } /* terminator */
+};
+#endif
+
 static struct lws_protocols protocols[] = {
     /* first protocol must always be HTTP handler */
     {
@@ -815,6 +1932,14 @@ static struct lws_protocols protocols[] = {
         2,
         NULL
     },
+    {
+        "notification-batch-protocol",
+        callback_notification,
+        sizeof(struct per_session_data__notif_client),
+        4000,
+        3,
+        NULL
+    },
     { NULL, NULL, 0, 0, 0, NULL } /* terminator */
 };
 
@@ -836,7 +1961,8 @@ notification_init(void)
 
     DEBUG("Initialization of libwebsocket");
     max_poll_elements = getdtablesize();
-    pollfds = malloc(max_poll_elements * sizeof (struct pollfd));
+    /* one more for the wakeup eventfd */
+    pollfds = malloc((max_poll_elements + 1) * sizeof (struct pollfd));
     fd_lookup = malloc(max_poll_elements * sizeof (int));
     if (pollfds == NULL || fd_lookup == NULL) {
         ERROR("notifications: Out of memory pollfds=%d\n", max_poll_elements);
@@ -845,6 +1971,9 @@ notification_init(void)
 
     info.iface = NULL;
     info.protocols = protocols;
+#if NOTIFICATION_DEFLATE
+    info.extensions = extensions;
+#endif
 
     snprintf(cert_path, sizeof(cert_path), NOTIF_SERVER_CERT_PATH);
     snprintf(key_path, sizeof(key_path), NOTIF_SERVER_PRIVKEY_PATH);
@@ -866,18 +1995,84 @@ notification_init(void)
     if (pthread_key_create(&thread_key, NULL) != 0) {
         ERROR("notifications: pthread_key_create failed");
     }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        ERROR("notifications: eventfd failed (%s)", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Websocket service thread, the only one using the libwebsocket context after notification_start().
+ */
+static void *
+notification_thread(void *UNUSED(arg))
+{
+    DEBUG("notifications: websocket service started.");
+    while (!__atomic_load_n(&service_stop, __ATOMIC_ACQUIRE)) {
+        if ((notification_handle(NOTIFICATION_SERVICE_TIMEOUT) < 0) && (errno != EINTR)) {
+            DEBUG("notifications: websocket service poll failed (%s).", strerror(errno));
+        }
+    }
+    DEBUG("notifications: websocket service stopped.");
+    return NULL;
+}
+
+int
+notification_start(void)
+{
+    if (pthread_create(&service_thread, NULL, notification_thread, NULL) != 0) {
+        ERROR("notifications: cannot create the websocket service thread.");
+        return -1;
+    }
+    service_running = 1;
     return 0;
 }
 
 void
 notification_close(void)
 {
+    struct notif_sub_job *jobs, *next;
+    uint64_t one = 1;
+
+    if (service_running) {
+        __atomic_store_n(&service_stop, 1, __ATOMIC_RELEASE);
+        if (write(wake_fd, &one, sizeof one) != sizeof one) {
+            ERROR("notifications: cannot wake up the websocket service (%s).", strerror(errno));
+        }
+        pthread_join(service_thread, NULL);
+        service_running = 0;
+    }
     if (context) {
         lws_context_destroy(context);
     }
+#if NOTIFICATION_BENCH
+    notif_frame_put(bench_frame);
+    bench_frame = NULL;
+#endif
     free(pollfds);
     free(fd_lookup);
 
+    /* the notification and subscription threads may still try to wake the service up */
+    pthread_mutex_lock(&wake_lock);
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    free(wake_sids);
+    wake_sids = NULL;
+    wake_count = wake_size = 0;
+    jobs = sub_done;
+    sub_done = NULL;
+    pthread_mutex_unlock(&wake_lock);
+
+    for (; jobs; jobs = next) {
+        next = jobs->next;
+        notif_sub_job_free(jobs);
+    }
+
     DEBUG("libwebsockets-test-server exited cleanly\n");
 }
 
@@ -887,35 +2082,33 @@ notification_close(void)
  * \return < 0 on error
  */
 int
-notification_handle()
+notification_handle(int timeout)
 {
-    static struct timeval tv;
-    static unsigned int olds = 0;
     int n = 0, fd_pos;
 
-    gettimeofday(&tv, NULL);
-
-    /*
-     * This provokes the LWS_CALLBACK_SERVER_WRITEABLE for every
-     * live websocket connection using the DUMB_INCREMENT protocol,
-     * as soon as it can take more packets (usually immediately)
-     */
-
-    if (((unsigned int)tv.tv_sec - olds) > 0) {
-        lws_callback_on_writable_all_protocol(context, &protocols[PROTOCOL_NOTIFICATION]);
-        olds = tv.tv_sec;
-    }
-
     /*
      * this represents an existing server's single poll action
-     * which also includes libwebsocket sockets
+     * which also includes libwebsocket sockets and the wakeup
+     * eventfd signalled with every new notification
      */
 
-    n = poll(pollfds, count_pollfds, 50);
+    /* batches waiting for more notifications */
+    timeout = notif_batch_timeout(timeout);
+
+    pollfds[count_pollfds].fd = wake_fd;
+    pollfds[count_pollfds].events = POLLIN;
+    pollfds[count_pollfds].revents = 0;
+    n = poll(pollfds, count_pollfds + 1, timeout);
     if (n < 0) {
         return n;
     }
 
+    if (pollfds[count_pollfds].revents & POLLIN) {
+        /* only the clients of sessions with new notifications become writeable */
+        notif_wakeup_process();
+        --n;
+    }
+
     if (n) {
         for (n = 0; n < count_pollfds; n++) {
             if (pollfds[n].revents & POLLHUP) {
@@ -962,7 +2155,7 @@ main(int argc, char **argv)
         return 1;
     }
     while (!force_exit) {
-        notification_handle();
+        notification_handle(50);
     }
     notification_close();
 }
@@ -52,6 +52,10 @@ typedef struct s {} server_rec;
 #define NOTIFICATION_SERVER_PORT	8080
 #endif
 
+#ifndef NOTIFICATION_SERVICE_TIMEOUT
+#define NOTIFICATION_SERVICE_TIMEOUT	1000
+#endif
+
 /**
  * \brief Notification module initialization
  * \return 0 on success
@@ -60,12 +64,26 @@ int notification_init();
 
 /**
  * \brief Handle method - passes execution into the libwebsocket library
+ * \param[in] timeout Maximum time in ms to wait for a websocket event or a notification.
  * \return 0 on success
  */
-int notification_handle();
+int notification_handle(int timeout);
+
+/**
+ * \brief Start the websocket service thread running the libwebsocket event loop
+ * \return 0 on success
+ */
+int notification_start();
+
+/**
+ * \brief Ask the websocket service to serve the clients of a NETCONF session, e.g. when
+ * it has new notifications or was closed. Can be called from any thread.
+ * \param[in] sid NETCONF session ID.
+ */
+void notification_wakeup(unsigned int sid);
 
 /**
- * \brief Notification module finalization
+ * \brief Notification module finalization, stops the service thread
  */
 void notification_close();
 